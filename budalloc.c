@@ -6,45 +6,36 @@
  * further down the tree. The bitree is walked with recursive algorithms for freeing and allocing.
  * On freeing if succesfull the result is bubbled up the recursion with the hope that continuous 
  * address space will be merged. No addresses are held, there is no other state apart 
- * from the bittree. Also a small crude cli tool is provided to perform fake allocations, deallocs
+ * from the bittree. Also a small crude cli tool (budallocrepl.c) is provided to perform fake allocations, deallocs
  * and examine the allocator state. Please don't be that person that gives non page aligned space to 
  * the allocator. noone likes that person.
  *
  * 16/11/19 spiros thanasoulas <dsp@2f30.org>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* fallocate */
+#endif
 #include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 
-/* 
- * if you change this you need to also calculate the number of bytes 
- * for the bitfields using (TOTCELLSFORLVL/4)+1 
- */
-#define TOTLVLS 4 
-#define BITFIELDBYTES    4 /*for totlvs 4*/
-#define TOTCELLSFORLVL(x, y) { int _x = 1; int _cnt = 0; (y) = 1; \
-				 while(++_cnt < (x)) {_x<<=1; (y) += _x; }}
-/*
- * for 16 levels we need 65535 cells, with 2 bits per cell we need 16384 bytes 
- * #define TOTLVLS 16
- * #define BITFIELDBYTES 16384
- */
-#define SETBIT(A,k)      ((A)[((k)/8)] |= (1 << ((k)%8)))
-#define CLEARBIT(A,k)    ((A)[((k)/8)] &= ~(1 << ((k)%8)))            
-#define TESTBIT(A,k)     ((A)[((k)/8)] & (1 << ((k)%8)))
-#define FREECELL(A,c)    (CLEARBIT((A),(2*(c)-1)) && CLEARBIT((A), (2*(c)-2))) /* 00 means free */
-#define ALLOCSPLIT(A,c)  (SETBIT((A),(2*(c)-1)) && CLEARBIT((A), (2*(c)-2)))  /* 10 means split */
-#define ALLOCCELL(A,c)   (SETBIT((A),(2*(c)-1)) && SETBIT((A), (2*(c)-2))) /* 11 means full */
-#define ISFULL(A,c)      (TESTBIT((A),(2*(c)-1)) && TESTBIT((A), (2*(c)-2))) /* tests for 11 */
-#define ISSPLIT(A,c)     (TESTBIT((A),(2*(c)-1)) && !TESTBIT((A), (2*(c)-2))) /* tests for 10 */
-#define ISFREE(A,c)      (!TESTBIT((A),(2*(c)-1)) && !TESTBIT((A), (2*(c)-2))) /* tests for 00 */
-#define LEFTCHILD(c)     (2 * (c))
-#define RIGHTCHILD(c)    ((2 * (c)) + 1)
+#include "budalloc.h"
+#include "budbits.h"
 
 #define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c"
 #define BYTE_TO_BINARY(byte)  \
@@ -57,297 +48,3254 @@
   (byte & 0x02 ? '1' : '0'), \
   (byte & 0x01 ? '1' : '0') 
 
-const char separator[] = "----------------------------------------------------";
-
 #ifdef DEBUG
-#define DTREEPRINTF(l, f, v...) do { printf("%.*s"f, l, separator, v);} while(0)
-#define DTREEPRINT(l, f) do { printf("%.*s"f, l, separator);} while(0)
+static const char separator[] = "----------------------------------------------------";
+
+#define DTREEPRINTF(l, f, v...) do { printf("%.*s" f, l, separator, v);} while(0)
+#define DTREEPRINT(l, f) do { printf("%.*s" f, l, separator);} while(0)
 #else
 #define DTREEPRINTF(l, f, v...)
 #define DTREEPRINT(l, f)
 #endif
 
-typedef struct buddy_allocator {
-	void *memstart;
-	size_t memsz;
-	size_t inuse, unused, requested;
-	unsigned char bits[BITFIELDBYTES];
-} buddy_allocator_t;
+/*
+ * static tracepoints for perf/bpftrace/systemtap. every probe has a
+ * semaphore that the tracer bumps when it attaches, so while nobody is
+ * listening a probe site costs a load and a not taken branch and the
+ * arguments are never computed. without sys/sdt.h (or with BUDNOSDT)
+ * they compile to nothing. all probes carry level, cell and the offset
+ * of the cell in the arena:
+ *   budalloc:alloc  cell marked full by an allocation
+ *   budalloc:split  free cell split on the way down to a smaller block
+ *   budalloc:free   full cell released
+ *   budalloc:merge  cell whose two buddies became free was merged
+ */
+#if !defined(BUDNOSDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+/* the single header gives every file its own copy of the probes */
+#ifdef BUDALLOC_HEADER_ONLY
+#define BPROBESEM(name) \
+	static unsigned short budalloc_##name##_semaphore __attribute__((unused, section(".probes")))
+#else
+#define BPROBESEM(name) \
+	unsigned short budalloc_##name##_semaphore __attribute__((unused, section(".probes")))
+#endif
+BPROBESEM(alloc);
+BPROBESEM(split);
+BPROBESEM(free);
+BPROBESEM(merge);
+#define BPROBE(name, lvl, cell, off) do { \
+	if (__builtin_expect(budalloc_##name##_semaphore, 0)) \
+		DTRACE_PROBE3(budalloc, name, (lvl), (cell), (off)); } while(0)
+#endif
+#endif
+#ifndef BPROBE
+#define BPROBE(name, lvl, cell, off)
+#endif
+/*
+ * size of the blocks on lvl. dividing by a power of two is the same as
+ * shifting for any memsz, so no level size ever costs a division.
+ */
+#define LVLSIZE(b, lvl)  ((b)->memsz >> ((lvl)-1))
+/* offset of the first byte covered by cell which lives on lvl */
+#define CELLOFFSET(b, lvl, cell) \
+	(((cell) - (1L << ((lvl)-1))) * LVLSIZE(b, lvl))
+
+/*
+ * BUDSTATS compiles in cheap latency accounting for alloc and free.
+ * every call is timed with the cycle counter and the result lands in a
+ * log2 bucket of a per-thread histogram, so the hot path only pays two
+ * counter reads and an increment. the per-thread arrays are chained on a
+ * global list and summed up by buddy_allocator_stats(). they count the
+ * calls on every allocator of the process, not just the one asked.
+ */
+#ifdef BUDSTATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BSTATCYCLES() ((uint64_t)__rdtsc())
+#elif defined(__aarch64__)
+static inline uint64_t
+bstatcycles(void)
+{
+	uint64_t v;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+}
+#define BSTATCYCLES() bstatcycles()
+#else
+#include <time.h>
+static inline uint64_t
+bstatcycles(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define BSTATCYCLES() bstatcycles()
+#endif
+
+struct bstat_thread {
+	uint64_t hist[BSTAT_NHIST][BSTATBUCKETS];
+	int owned;
+	struct bstat_thread *next;
+};
+
+/*
+ * the per-thread arrays are never released so that a stats call can still
+ * sum up the samples of threads that already exited. a thread gives its
+ * array back when it exits and the next new thread keeps counting in it,
+ * so there are only ever as many as there were threads at once.
+ */
+static struct bstat_thread *bstat_threads;
+static __thread struct bstat_thread *bstat_self;
+static pthread_key_t bstat_key;
+static pthread_once_t bstat_once = PTHREAD_ONCE_INIT;
+
+static void
+bstat_release(void *arg)
+{
+	struct bstat_thread *t = (struct bstat_thread *)arg;
+	bstat_self = NULL;
+	__atomic_store_n(&t->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void
+bstat_keyinit(void)
+{
+	pthread_key_create(&bstat_key, bstat_release);
+}
+
+static struct bstat_thread *
+bstat_register(void)
+{
+	struct bstat_thread *t;
+	int unowned;
+	pthread_once(&bstat_once, bstat_keyinit);
+	for (t = __atomic_load_n(&bstat_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+		unowned = 0;
+		if (__atomic_load_n(&t->owned, __ATOMIC_RELAXED) == 0 &&
+		    __atomic_compare_exchange_n(&t->owned, &unowned, 1, false,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (t == NULL) {
+		if ((t = (struct bstat_thread *)calloc(1, sizeof(*t))) == NULL) {
+			return NULL;
+		}
+		t->owned = 1;
+		t->next = __atomic_load_n(&bstat_threads, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&bstat_threads, &t->next, t, true,
+		    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	bstat_self = t;
+	pthread_setspecific(bstat_key, t);
+	return t;
+}
+
+static inline void
+bstat_record(int h, uint64_t start)
+{
+	struct bstat_thread *t = bstat_self;
+	uint64_t d = BSTATCYCLES() - start;
+	int bucket = 63 - __builtin_clzll(d | 1);
+	if (t == NULL && (t = bstat_register()) == NULL) {
+		return;
+	}
+	__atomic_store_n(&t->hist[h][bucket], t->hist[h][bucket] + 1, __ATOMIC_RELAXED);
+}
+
+#define BSTATSTART(v)    uint64_t v = BSTATCYCLES()
+#define BSTATEND(h, v)   bstat_record((h), (v))
+#else
+#define BSTATSTART(v)
+#define BSTATEND(h, v)
+#endif
+
+/*
+ * BUDPROF compiles in a sampling allocation profiler. one in every rate
+ * allocations (on average, the stride is randomized so that periodic
+ * workloads don't alias) captures a backtrace which is kept in a table
+ * keyed by offset until the block is freed again. a dump writes the live
+ * samples as folded stacks weighted by the estimated bytes they hold, so
+ * it can be fed straight to flamegraph.pl or speedscope.
+ */
+#ifdef BUDPROF
+#include <execinfo.h>
+
+#define BPROFDEPTH   32
+#define BPROFBUCKETS 1024
+
+struct bprof_sample {
+	size_t offset;
+	size_t requested, blocksz;
+	int depth;
+	void *pcs[BPROFDEPTH];
+	struct bprof_sample *next;
+};
+
+struct bprof {
+	unsigned long rate;
+	unsigned long countdown;
+	uint64_t rnd;
+	size_t nlive;
+	struct bprof_sample *live[BPROFBUCKETS];
+};
+#endif
+
+
+
+#ifndef BUDALLOC_HEADER_ONLY
+/* the depth this file was built for, see budalloc.h */
+const int BUDDY_ABISYM(TOTLVLS) = TOTLVLS;
+#endif
+
+/*
+ * set up an allocator in memory the caller provides, for when it can't
+ * come from malloc, e.g. inside a shared mapping. such an allocator must
+ * not be passed to buddy_allocator_destroy().
+ */
+BUDAPI void
+buddy_allocator_init(buddy_allocator_t *b, void *raw_mem, size_t memsz)
+{
+	memset(b, 0, sizeof(*b));
+	b->memstart = raw_mem;
+	b->memsz = memsz;
+	b->unused = memsz;
+	if (memsz >= 1UL << (TOTLVLS-1) && (memsz & (memsz - 1)) == 0) {
+		b->shift = __builtin_ctzll(memsz);
+	}
+}
 
-buddy_allocator_t *
+BUDAPI buddy_allocator_t *
 buddy_allocator_create(void *raw_mem, size_t memsz)
 {
-	buddy_allocator_t *ret = malloc(sizeof(buddy_allocator_t));
+	buddy_allocator_t *ret = (buddy_allocator_t *)malloc(sizeof(buddy_allocator_t));
 	if (ret == NULL) {
 		printf("failed to allocate memory for buddy allocator\n");
 	} else {
-		ret->memstart = raw_mem;
-		ret->memsz = memsz;
-		ret->unused = memsz;
+		buddy_allocator_init(ret, raw_mem, memsz);
 	}
 	return ret;
 }
 
-void
+
+BUDAPI void
 buddy_allocator_destroy(buddy_allocator_t *balloc)
 {
 	if (balloc != NULL) {
+#ifdef BUDPROF
+		buddy_allocator_prof_stop(balloc);
+#endif
+		free(balloc->epochs);
+		free(balloc->freemap);
 		free(balloc);
 	}
 	return;
 }
 
 
+
 struct allocationInfo {
 	bool success;
+	int lvl;
+	long cell;
 	size_t offset;
+	size_t blocksz;
 };
 
+/*
+ * the level a request of sz bytes is placed on, the deepest one whose
+ * blocks still hold it, or 0 when it can't be placed at all. a power of
+ * two arena gets it from the bit length of sz-1, any other size walks the
+ * level sizes once instead of comparing against them in every cell.
+ */
+static inline int
+targetlevel(size_t memsz, int shift, size_t sz)
+{
+	int lvl, minshift;
+	if (sz == 0 || sz > memsz) {
+		return 0;
+	}
+	if (shift != 0) {
+		minshift = shift - (TOTLVLS-1);
+		if (sz <= 1UL << minshift) {
+			return TOTLVLS;
+		}
+		return TOTLVLS - (64 - __builtin_clzll(sz - 1) - minshift);
+	}
+	for (lvl = 1; lvl < TOTLVLS && (memsz >> lvl) >= sz; lvl++)
+		;
+	return lvl;
+}
+
+/*
+ * offset of a cell added up from the level sizes like the walks do it,
+ * which is CELLOFFSET() when memsz is a power of two
+ */
+static inline size_t
+walkoffset(buddy_allocator_t *b, int lvl, long cell)
+{
+	size_t off = 0;
+	int l;
+	if (b->shift != 0) {
+		return CELLOFFSET(b, lvl, cell);
+	}
+	for (l = 2; l <= lvl; l++) {
+		if ((cell >> (lvl - l)) & 1) {
+			off += LVLSIZE(b, l);
+		}
+	}
+	return off;
+}
+
 /* 
- * recursivelly go down the tree till you get to the correct level
+ * recursivelly go down the tree till you get to the correct level (tlvl)
  * and try to allocate there.  
  * if it returns false it means allocation failed, otherwise the offset
  * will be added to the base pointer.
  */
-struct allocationInfo
-allocRecurse(buddy_allocator_t *b, size_t hm, int lvl, long cell)
+static struct allocationInfo
+allocRecurse(buddy_allocator_t *b, size_t hm, int tlvl, int lvl, long cell)
 {
 	struct allocationInfo ret, childret;
-	size_t minAlloc, maxAlloc;
+	size_t maxAlloc;
+	bool wasfree;
 	ret.success = false;
 	ret.offset = 0;
+	ret.blocksz = 0;
 	childret.offset = 0;
-	if (lvl > TOTLVLS || hm == 0) {
+	if (lvl > tlvl) {
 		DTREEPRINT(lvl, "terminating recursion return 0\n");
 		ret.success = false;
 		return ret;
 	}
-	maxAlloc = (b->memsz)/(1<<(lvl-1));
-	minAlloc = (b->memsz)/((1<<(lvl-1))<<1);
+	/* a full cell covers its whole subtree, nothing fits below it */
+	if (ISFULL(b->bits, cell)) {
+		DTREEPRINT(lvl, "cell full.\n");
+		return ret;
+	}
+	maxAlloc = LVLSIZE(b, lvl);
 	DTREEPRINTF(lvl, "lvl %d at cell:%ld max alloc sz:%zd  min alloc sz:%zd"
-			 "want to alloc:%zd\n", lvl, cell, maxAlloc, minAlloc, hm);
-	if ((minAlloc < hm  && hm <= maxAlloc) || 
-	    (lvl == TOTLVLS && hm <= minAlloc)) { 
+			 "want to alloc:%zd\n", lvl, cell, maxAlloc, LVLSIZE(b, lvl+1), hm);
+	if (lvl == tlvl) {
 		/* this is the lvl where we should place it */
 		DTREEPRINT(lvl, "want to alloc here\n");
-		/* if we're free mark us alloced (11) */
-		if (ISFULL(b->bits, cell)) {
-			DTREEPRINT(lvl, " cell full.\n");
+		/* only a free cell can be marked alloced (11), a split one has children in use */
+		if (!ISFREE(b->bits, cell)) {
+			DTREEPRINT(lvl, " cell split.\n");
 			ret.success = false;
 			return ret;
 		} else {
 			ALLOCCELL(b->bits, cell);
+			BPROBE(alloc, lvl, cell, walkoffset(b, lvl, cell));
 			DTREEPRINT(lvl, " alloced the cell. returning success\n");
 			ret.success = true;
+			ret.lvl = lvl;
+			ret.cell = cell;
+			ret.blocksz = maxAlloc;
 			b->requested += hm;
 			b->inuse += maxAlloc;
 			b->unused -= maxAlloc;
 			return ret ;
 		}
 	}
-	childret = allocRecurse(b, hm, lvl+1, LEFTCHILD(cell));
+	wasfree = ISFREE(b->bits, cell);
+	childret = allocRecurse(b, hm, tlvl, lvl+1, LEFTCHILD(cell));
 	if (!childret.success) {
 		DTREEPRINTF(lvl, "left failed %d going right\n", ret.success);
-		childret = allocRecurse(b, hm, lvl+1, RIGHTCHILD(cell));
+		childret = allocRecurse(b, hm, tlvl, lvl+1, RIGHTCHILD(cell));
 		if (!childret.success) {
 			DTREEPRINTF(lvl, "right failed too %d\n", ret.success);
 			return childret;
 		}
 		ALLOCSPLIT(b->bits, cell);
+		if (wasfree) {
+			BPROBE(split, lvl, cell, walkoffset(b, lvl, cell));
+		}
 		/* 
  		 * if we just allocated a right child, 
 		 * add the offset of the min alloc at his lvl 
 		 */
-		childret.offset += (b->memsz)/(1<<lvl);
+		childret.offset += LVLSIZE(b, lvl+1);
 		DTREEPRINTF(lvl, "offset is now at :%zd\n", childret.offset);
 		return childret;
 	} 
 	ALLOCSPLIT(b->bits, cell);
+	if (wasfree) {
+		BPROBE(split, lvl, cell, walkoffset(b, lvl, cell));
+	}
 	return childret;
 }
 
-/* just a placeholder with a boolean that could hold more info in the future */
+/* whether the free hit a full cell and on which level it was */
 struct freeInfo {
 	bool success;
+	int lvl;
 };
 
-struct freeInfo
+/*
+ * off is relative to the start of cell. a full cell can only be freed
+ * through its first byte, anything else is a pointer inside the block.
+ * split cells pass the offset to the half that contains it and on the
+ * way back up merge the two buddies if both ended up free.
+ */
+static struct freeInfo
 freeRecurse(buddy_allocator_t *b, size_t off, int lvl, long cell)
 {
 	struct freeInfo childret, ret;
 	size_t minAlloc, maxAlloc;
-	/* 
-	 * if the offset is less than the minlvl recurse. 
- 	 * if you go right, remove from the offset 
- 	 * */
+	ret.success = false;
 	if (lvl > TOTLVLS) {
 		DTREEPRINT(lvl, "terminating recursion return false\n");
-		ret.success = false;
 		return ret;
 	}
-	minAlloc = (b->memsz)/(1<<(lvl-1)<<1);
-	maxAlloc = (b->memsz)/(1<<(lvl-1));
+	minAlloc = LVLSIZE(b, lvl+1);
+	maxAlloc = LVLSIZE(b, lvl);
 	DTREEPRINTF(lvl, "lvl %d at cell:%ld max alloc sz:%zd  min alloc sz:%zd" 
 			 " free offset:%zd\n", lvl, cell, maxAlloc, minAlloc, off);
-	/* the modulo on the following makes sure we don't free inbetweens */
-	if (off >= 0 && off <= maxAlloc && off > minAlloc && off % minAlloc == 0) { /* it could be on that level */
-		if (ISFULL(b->bits, cell)) {
-			DTREEPRINT(lvl, "freeing it.\n");
-			FREECELL(b->bits, cell);
-			ret.success = true;
-			b->inuse -= maxAlloc;
-			b->unused += maxAlloc;
+	if (ISFULL(b->bits, cell)) {
+		if (off != 0) {
+			DTREEPRINT(lvl, "offset inside a full cell. not freeing\n");
 			return ret;
 		}
-		/* else it could be deeper */
-		DTREEPRINTF(lvl, "trying left with offset:%zd\n", off);
+		DTREEPRINT(lvl, "freeing it.\n");
+		FREECELL(b->bits, cell);
+		BPROBE(free, lvl, cell, walkoffset(b, lvl, cell));
+		ret.success = true;
+		ret.lvl = lvl;
+		b->inuse -= maxAlloc;
+		b->unused += maxAlloc;
+		return ret;
+	}
+	if (!ISSPLIT(b->bits, cell)) {
+		DTREEPRINT(lvl, "cell is free. nothing to do\n");
+		return ret;
+	}
+	if (off < minAlloc) {
+		DTREEPRINTF(lvl, "recursing left with offset:%zd\n", off);
 		childret = freeRecurse(b, off, lvl+1, LEFTCHILD(cell));
-		if (!childret.success && off >= minAlloc) {
-			DTREEPRINTF(lvl, "trying left failed, trying right"
-					 " with offset:%zd\n", off-minAlloc);
-			childret = freeRecurse(b, off-minAlloc, lvl+1, RIGHTCHILD(cell));
-		}
-		if (childret.success) {
-			DTREEPRINT(lvl, "child successfully freed. trying to merge\n"); 
-			if (ISFREE(b->bits, LEFTCHILD(cell)) && ISFREE(b->bits, RIGHTCHILD(cell))) {
-				DTREEPRINT(lvl, "merged\n");
-				FREECELL(b->bits, cell);
+	} else {
+		DTREEPRINTF(lvl, "recursing right with offset:%zd\n", off-minAlloc);
+		childret = freeRecurse(b, off-minAlloc, lvl+1, RIGHTCHILD(cell));
+	}
+	if (childret.success) {
+		DTREEPRINT(lvl, "child successfully freed. trying to merge\n"); 
+		if (ISFREE(b->bits, LEFTCHILD(cell)) && ISFREE(b->bits, RIGHTCHILD(cell))) {
+			DTREEPRINT(lvl, "merged\n");
+			FREECELL(b->bits, cell);
+			BPROBE(merge, lvl, cell, walkoffset(b, lvl, cell));
+		}
+	}
+	return childret;
+}
+
+/*
+ * the iterative walks do exactly what allocRecurse and freeRecurse do, in
+ * the same order, without the recursion. the path down to a cell is the
+ * cell number itself (the parent of c is c>>1 and c&1 says which child it
+ * is) so the whole walk lives in a few registers. offsets are added up
+ * from the level sizes the same way the recursion does it, which for
+ * arenas that aren't a power of two is not always CELLOFFSET().
+ */
+static struct allocationInfo
+allocWalk(buddy_allocator_t *b, size_t hm, int tlvl)
+{
+	struct allocationInfo ret;
+	size_t off = 0;
+	long cell = 1;
+	int lvl = 1;
+	ret.success = false;
+	ret.offset = 0;
+	ret.blocksz = 0;
+	if (tlvl == 0) {
+		return ret;
+	}
+	for (;;) {
+		if (!ISFULL(b->bits, cell) && (lvl < tlvl || ISFREE(b->bits, cell))) {
+			if (lvl == tlvl) {
+				break;
 			}
+			if (ISFREE(b->bits, cell)) {
+				/* nothing below a free cell is in use, its leftmost descendant fits */
+				cell <<= tlvl - lvl;
+				lvl = tlvl;
+				break;
+			}
+			cell = LEFTCHILD(cell);
+			lvl++;
+			continue;
 		}
-		return childret;
+		/* back up past every right child, then try the right sibling */
+		for (; cell & 1; cell >>= 1, lvl--) {
+			if (cell == 1) {
+				return ret;
+			}
+			off -= LVLSIZE(b, lvl);
+		}
+		cell++;
+		off += LVLSIZE(b, lvl);
 	}
-	if (ISSPLIT(b->bits, cell) || ISFULL(b->bits, cell)) {
-		/* check left */
-		DTREEPRINTF(lvl, "offset is off. recursing left with offset:%zd\n", off);
-		childret = freeRecurse(b, off, lvl+1, LEFTCHILD(cell));
-		if (!childret.success && off >= minAlloc ) { 
-			/* check right but only go if the offset is larger than the min alloc */
-			DTREEPRINTF(lvl, "left failed, recursing right"
-					 " with offset:%zd\n", off-minAlloc);
-			childret = freeRecurse(b, off-minAlloc, lvl+1, RIGHTCHILD(cell));
-		}
-		if (childret.success) {
-			DTREEPRINT(lvl, "child successfully freed. trying to merge\n"); 
-			if (ISFREE(b->bits, LEFTCHILD(cell)) && ISFREE(b->bits, RIGHTCHILD(cell))) {
-				DTREEPRINT(lvl, "merged\n");
-				FREECELL(b->bits, cell);
+	ALLOCCELL(b->bits, cell);
+	BPROBE(alloc, lvl, cell, off);
+	ret.success = true;
+	ret.lvl = lvl;
+	ret.cell = cell;
+	ret.offset = off;
+	ret.blocksz = LVLSIZE(b, lvl);
+	b->requested += hm;
+	b->inuse += ret.blocksz;
+	b->unused -= ret.blocksz;
+	for (; lvl > 1; lvl--) {
+		cell >>= 1;
+		if (ISFREE(b->bits, cell)) {
+			ALLOCSPLIT(b->bits, cell);
+			BPROBE(split, lvl-1, cell, walkoffset(b, lvl-1, cell));
+		}
+	}
+	return ret;
+}
+
+static struct freeInfo
+freeWalk(buddy_allocator_t *b, size_t off)
+{
+	struct freeInfo ret;
+	long cell = 1;
+	int lvl;
+	ret.success = false;
+	for (lvl = 1; !ISFULL(b->bits, cell); lvl++) {
+		if (lvl == TOTLVLS || !ISSPLIT(b->bits, cell)) {
+			return ret;
+		}
+		if (off < LVLSIZE(b, lvl+1)) {
+			cell = LEFTCHILD(cell);
+		} else {
+			off -= LVLSIZE(b, lvl+1);
+			cell = RIGHTCHILD(cell);
+		}
+	}
+	if (off != 0) {
+		return ret;
+	}
+	FREECELL(b->bits, cell);
+	BPROBE(free, lvl, cell, walkoffset(b, lvl, cell));
+	ret.success = true;
+	ret.lvl = lvl;
+	b->inuse -= LVLSIZE(b, lvl);
+	b->unused += LVLSIZE(b, lvl);
+	for (; lvl > 1; lvl--) {
+		cell >>= 1;
+		if (!ISFREE(b->bits, LEFTCHILD(cell)) || !ISFREE(b->bits, RIGHTCHILD(cell))) {
+			break;
+		}
+		FREECELL(b->bits, cell);
+		BPROBE(merge, lvl-1, cell, walkoffset(b, lvl-1, cell));
+	}
+	return ret;
+}
+
+/*
+ * the freemap engine keeps a bit per cell that is set for the blocks that
+ * can be handed out as they are, free cells whose parent is split (or a
+ * free root). it is the free area of the classic buddy allocators laid
+ * over the bittree: alloc takes the lowest set bit on the target level,
+ * or splits the lowest one of the nearest level above that has any, and
+ * free merges up while the buddy is free. levels share the bitmap the way
+ * they share the tree, cell c is bit c. count says how many bits a level
+ * has set and hint is a word below which the level has none, so the
+ * common alloc looks at one word.
+ */
+struct bfreemap {
+	size_t count[TOTLVLS+1];
+	size_t hint[TOTLVLS+1];
+	uint64_t w[];
+};
+#define FMWORDS ((1UL << TOTLVLS) / 64 + 1)
+
+static inline void
+fmset(struct bfreemap *m, int lvl, long cell)
+{
+	m->w[cell >> 6] |= 1ULL << (cell & 63);
+	m->count[lvl]++;
+	if ((size_t)(cell >> 6) < m->hint[lvl]) {
+		m->hint[lvl] = cell >> 6;
+	}
+}
+
+static inline void
+fmclear(struct bfreemap *m, int lvl, long cell)
+{
+	m->w[cell >> 6] &= ~(1ULL << (cell & 63));
+	m->count[lvl]--;
+}
+
+/* lowest cell with its bit set on lvl, the level must have one */
+static inline long
+fmfirst(struct bfreemap *m, int lvl)
+{
+	long lo = 1L << (lvl-1), hi = 1L << lvl;
+	size_t i = m->hint[lvl] > (size_t)(lo >> 6) ? m->hint[lvl] : (size_t)(lo >> 6);
+	uint64_t w;
+	for (;; i++) {
+		w = m->w[i];
+		if (lo < 64) {
+			/* the first levels share word 0 */
+			w &= ~0ULL << lo;
+			if (hi < 64) {
+				w &= (1ULL << hi) - 1;
 			}
 		}
-		return childret;
+		if (w != 0) {
+			m->hint[lvl] = i;
+			return (long)(i << 6) + __builtin_ctzll(w);
+		}
+	}
+}
 
+static int
+fmbuild(buddy_allocator_t *b)
+{
+	struct bfreemap *m;
+	long cell;
+	int lvl;
+	if ((m = (struct bfreemap *)calloc(1, sizeof(*m) + FMWORDS * sizeof(uint64_t))) == NULL) {
+		return -1;
+	}
+	for (lvl = 1; lvl <= TOTLVLS; lvl++) {
+		for (cell = 1L << (lvl-1); cell < 1L << lvl; cell++) {
+			if (ISFREE(b->bits, cell) && (cell == 1 || ISSPLIT(b->bits, cell >> 1))) {
+				fmset(m, lvl, cell);
+			}
+		}
 	}
+	b->freemap = m;
+	return 0;
 }
 
-void *
-buddy_allocator_alloc(buddy_allocator_t *b, size_t sz)
+static struct allocationInfo
+allocMap(buddy_allocator_t *b, size_t hm, int tlvl)
 {
+	struct bfreemap *m = b->freemap;
 	struct allocationInfo ret;
-	ret = allocRecurse(b, sz, 1, 1);
-	if (ret.success) {
-		return b->memstart + ret.offset;
+	long cell;
+	int lvl;
+	ret.success = false;
+	ret.offset = 0;
+	ret.blocksz = 0;
+	for (lvl = tlvl; lvl > 0 && m->count[lvl] == 0; lvl--)
+		;
+	if (lvl == 0) {
+		return ret;
 	}
-	return NULL;
+	cell = fmfirst(m, lvl);
+	fmclear(m, lvl, cell);
+	/* split down to the target level, every right half is a new free block */
+	for (; lvl < tlvl; lvl++) {
+		ALLOCSPLIT(b->bits, cell);
+		BPROBE(split, lvl, cell, walkoffset(b, lvl, cell));
+		fmset(m, lvl+1, RIGHTCHILD(cell));
+		cell = LEFTCHILD(cell);
+	}
+	ALLOCCELL(b->bits, cell);
+	ret.success = true;
+	ret.lvl = lvl;
+	ret.cell = cell;
+	ret.offset = walkoffset(b, lvl, cell);
+	BPROBE(alloc, lvl, cell, ret.offset);
+	ret.blocksz = LVLSIZE(b, lvl);
+	b->requested += hm;
+	b->inuse += ret.blocksz;
+	b->unused -= ret.blocksz;
+	return ret;
 }
 
-void
-buddy_allocator_free(buddy_allocator_t *b, void *ptr)
+/* free the full cell on lvl and merge it up, keeping the freemap in step */
+static void
+fmrelease(buddy_allocator_t *b, int lvl, long cell)
+{
+	struct bfreemap *m = b->freemap;
+	FREECELL(b->bits, cell);
+	BPROBE(free, lvl, cell, walkoffset(b, lvl, cell));
+	/* a free buddy under a split parent is always on the freemap */
+	for (; lvl > 1 && ISFREE(b->bits, cell ^ 1); lvl--) {
+		fmclear(m, lvl, cell ^ 1);
+		cell >>= 1;
+		FREECELL(b->bits, cell);
+		BPROBE(merge, lvl-1, cell, walkoffset(b, lvl-1, cell));
+	}
+	fmset(m, lvl, cell);
+}
+
+static struct freeInfo
+freeMap(buddy_allocator_t *b, size_t off)
 {
 	struct freeInfo ret;
-	if (ptr == NULL) {
-		fprintf(stderr, "free on null requested\n");
-		return;
-	} else if (ptr < b->memstart || ptr >= b->memstart+b->memsz){
-		fprintf(stderr, "free on range not belonging to the allocator");
-		return;
+	long cell = 1;
+	int lvl;
+	ret.success = false;
+	for (lvl = 1; !ISFULL(b->bits, cell); lvl++) {
+		if (lvl == TOTLVLS || !ISSPLIT(b->bits, cell)) {
+			return ret;
+		}
+		if (off < LVLSIZE(b, lvl+1)) {
+			cell = LEFTCHILD(cell);
+		} else {
+			off -= LVLSIZE(b, lvl+1);
+			cell = RIGHTCHILD(cell);
+		}
 	}
-	freeRecurse(b, ptr-b->memstart, 1, 1);
-} 
+	if (off != 0) {
+		return ret;
+	}
+	ret.success = true;
+	ret.lvl = lvl;
+	b->inuse -= LVLSIZE(b, lvl);
+	b->unused += LVLSIZE(b, lvl);
+	fmrelease(b, lvl, cell);
+	return ret;
+}
 
-void
-buddy_allocator_print(buddy_allocator_t *balloc)
+/*
+ * pick how the tree is walked. the iterative walk is the default, the
+ * recursive one is the original and stays around as the reference the
+ * other engines are checked against. the freemap engine builds its
+ * bitmaps from the tree when it is picked and drops them when it isn't
+ * anymore, so the engine can be changed at any time.
+ */
+BUDAPI int
+buddy_allocator_engine(buddy_allocator_t *b, int engine)
 {
-	int bi;
-	printf("start @%p\tsize:%zd\tinuse:%zd\trequessted:%zd\tfree:%zd\n",
-		balloc->memstart, balloc->memsz, balloc->inuse, balloc->requested, balloc->unused);
-	for (bi = BITFIELDBYTES-1; bi >= 0; bi--) {
-		printf("["BYTE_TO_BINARY_PATTERN"],", 
-			BYTE_TO_BINARY(balloc->bits[bi]));
-	} 
-	printf("\n");
-		
+	if (engine != BUDDY_ENGINE_ITERATIVE && engine != BUDDY_ENGINE_RECURSIVE &&
+	    engine != BUDDY_ENGINE_FREEMAP) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (engine == BUDDY_ENGINE_FREEMAP && b->freemap == NULL && fmbuild(b) == -1) {
+		return -1;
+	}
+	if (engine != BUDDY_ENGINE_FREEMAP) {
+		free(b->freemap);
+		b->freemap = NULL;
+	}
+	b->engine = engine;
+	return 0;
 }
 
-void
-repl(buddy_allocator_t *b)
+#ifdef BUDPROF
+static inline unsigned int
+bprof_hash(size_t off)
 {
-	char cmd;
-	long val;
-	void *tofree;
-	long cells;
-	TOTCELLSFORLVL(TOTLVLS,cells);
-	printf("compiled for %d levels which provides %ld allocation cells\n", TOTLVLS, cells);
-	for (;;) {
-		printf(">");
-		scanf(" %c", &cmd);
-		switch(cmd) {
-		case 'Q':
+	return ((uint64_t)off * 0x9E3779B97F4A7C15ULL) >> 54;
+}
+
+/* next stride, uniform in [1, 2*rate-1] so that it averages to rate */
+static unsigned long
+bprof_stride(struct bprof *p)
+{
+	p->rnd ^= p->rnd << 13;
+	p->rnd ^= p->rnd >> 7;
+	p->rnd ^= p->rnd << 17;
+	if (p->rate <= 1) {
+		return 1;
+	}
+	return 1 + p->rnd % (2 * p->rate - 1);
+}
+
+/* 
+ * kept out of line so that frame 0 of every backtrace is always us
+ * and the dump can drop it.
+ */
+static __attribute__((noinline)) void
+bprof_sample(buddy_allocator_t *b, size_t off, size_t hm, size_t blocksz)
+{
+	struct bprof *p = b->prof;
+	struct bprof_sample *s;
+	unsigned int h;
+	p->countdown = bprof_stride(p);
+	s = (struct bprof_sample *)malloc(sizeof(*s));
+	if (s == NULL) {
+		return;
+	}
+	s->offset = off;
+	s->requested = hm;
+	s->blocksz = blocksz;
+	s->depth = backtrace(s->pcs, BPROFDEPTH);
+	h = bprof_hash(off);
+	s->next = p->live[h];
+	p->live[h] = s;
+	p->nlive++;
+}
+
+static void
+bprof_drop(buddy_allocator_t *b, size_t off)
+{
+	struct bprof *p = b->prof;
+	struct bprof_sample **sp, *s;
+	for (sp = &p->live[bprof_hash(off)]; (s = *sp) != NULL; sp = &s->next) {
+		if (s->offset == off) {
+			*sp = s->next;
+			free(s);
+			p->nlive--;
 			return;
-		case 'A':
-			printf("how many?\n>");
-			scanf(" %zd", &val);
-			printf("Alloc @ %p\n", buddy_allocator_alloc(b, val));
-			break;
-		case 'F':
-			printf("which addr?\n>");
-			scanf(" %p", &tofree);
-			buddy_allocator_free(b, tofree);
-			break;
-		case 'P':
-			buddy_allocator_print(b);
-			break;
-		default:
-			printf("Q to quit, A to allocate, F to free, P to print\n"); 
-			break;
 		}
 	}
-	
 }
 
-void
-usage()
+/* 
+ * start sampling one in rate allocations. calling it again only changes
+ * the rate, live samples are kept.
+ */
+BUDAPI int
+buddy_allocator_prof_start(buddy_allocator_t *b, unsigned long rate)
 {
-	fprintf(stderr, "usage:budalloc bytenumber\n");
+	if (b->prof == NULL) {
+		b->prof = (struct bprof *)calloc(1, sizeof(struct bprof));
+		if (b->prof == NULL) {
+			return -1;
+		}
+		b->prof->rnd = (uintptr_t)b ^ 0x2545F4914F6CDD1DULL;
+	}
+	b->prof->rate = rate ? rate : 1;
+	b->prof->countdown = bprof_stride(b->prof);
+	return 0;
 }
 
-int
-main(int argc, char *argv[])
+BUDAPI void
+buddy_allocator_prof_stop(buddy_allocator_t *b)
 {
-	int res;
-	long long in;
-	char *ep;
-	buddy_allocator_t *b;
-	if (argc != 2) {
-		usage();
-		return EXIT_FAILURE;
+	struct bprof_sample *s, *n;
+	int i;
+	if (b->prof == NULL) {
+		return;
 	}
-	in = strtoll(argv[1], &ep, 10);
-        if (argv[1][0] == '\0' || *ep != '\0') {
-		usage();
+	for (i = 0; i < BPROFBUCKETS; i++) {
+		for (s = b->prof->live[i]; s != NULL; s = n) {
+			n = s->next;
+			free(s);
+		}
 	}
-        if (errno == ERANGE && (in == LLONG_MAX || in == LLONG_MIN)) {
-		warnx("num range");
+	free(b->prof);
+	b->prof = NULL;
+}
+
+/* pull func out of backtrace_symbols' "binary(func+0x1f) [0xaddr]" */
+static void
+bprof_frame(FILE *out, const char *sym, void *pc)
+{
+	const char *o = strchr(sym, '('), *e;
+	if (o != NULL && o[1] != '+' && o[1] != ')') {
+		e = strpbrk(o + 1, "+)");
+		if (e != NULL) {
+			fprintf(out, "%.*s", (int)(e - o - 1), o + 1);
+			return;
+		}
 	}
+	fprintf(out, "%p", pc);
+}
 
-	if (in > SIZE_MAX || in <= 0) {
-		warnx("invalid arena size requested\n");
+/*
+ * write the live samples in folded stack format, root frame first, one
+ * line per sample weighted with blocksz*rate. identical stacks are left
+ * for the consumer to sum up like every folded stack tool does.
+ */
+BUDAPI void
+buddy_allocator_prof_dump(buddy_allocator_t *b, FILE *out)
+{
+	struct bprof_sample *s;
+	char **syms;
+	int i, f;
+	if (b->prof == NULL) {
+		return;
+	}
+	for (i = 0; i < BPROFBUCKETS; i++) {
+		for (s = b->prof->live[i]; s != NULL; s = s->next) {
+			syms = backtrace_symbols(s->pcs, s->depth);
+			for (f = s->depth - 1; f >= 1; f--) {
+				if (syms != NULL) {
+					bprof_frame(out, syms[f], s->pcs[f]);
+				} else {
+					fprintf(out, "%p", s->pcs[f]);
+				}
+				fputc(f > 1 ? ';' : ' ', out);
+			}
+			fprintf(out, "%zu\n", s->blocksz * b->prof->rate);
+			free(syms);
+		}
 	}
-	void *arena = malloc(in);
-	if (arena == NULL) {
-		warnx("failed to allocate %lld bytes\n", in);
+}
+
+#define BPROFALLOC(b, off, hm, bsz) do { \
+	if ((b)->prof != NULL && --(b)->prof->countdown == 0) \
+		bprof_sample((b), (off), (hm), (bsz)); } while(0)
+#define BPROFFREE(b, off) do { \
+	if ((b)->prof != NULL && (b)->prof->nlive != 0) \
+		bprof_drop((b), (off)); } while(0)
+#else
+BUDAPI int
+buddy_allocator_prof_start(buddy_allocator_t *b, unsigned long rate)
+{
+	(void)b;
+	(void)rate;
+	errno = ENOSYS;
+	return -1;
+}
+
+BUDAPI void
+buddy_allocator_prof_stop(buddy_allocator_t *b)
+{
+	(void)b;
+}
+
+BUDAPI void
+buddy_allocator_prof_dump(buddy_allocator_t *b, FILE *out)
+{
+	(void)b;
+	(void)out;
+}
+
+#define BPROFALLOC(b, off, hm, bsz)
+#define BPROFFREE(b, off)
+#endif
+
+/*
+ * the counters are already up to date in b, copy them over and account
+ * for the one cell that changed state on lvl.
+ */
+static inline void
+bshm_update(buddy_allocator_t *b, int lvl, int delta)
+{
+	struct buddy_shm_page *pg = b->shm;
+	uint64_t seq = pg->seq;
+	__atomic_store_n(&pg->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&pg->inuse, b->inuse, __ATOMIC_RELAXED);
+	__atomic_store_n(&pg->unused, b->unused, __ATOMIC_RELAXED);
+	__atomic_store_n(&pg->requested, b->requested, __ATOMIC_RELAXED);
+	__atomic_store_n(&pg->lvlfull[lvl-1], pg->lvlfull[lvl-1] + delta, __ATOMIC_RELAXED);
+	__atomic_store_n(&pg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#define BSHMUPDATE(b, lvl, delta) do { \
+	if ((b)->shm != NULL) \
+		bshm_update((b), (lvl), (delta)); } while(0)
+
+/*
+ * create (or take over) the posix shm object name and keep publishing the
+ * counters of b into it till buddy_allocator_shm_unpublish().
+ */
+BUDAPI int
+buddy_allocator_shm_publish(buddy_allocator_t *b, const char *name)
+{
+	struct buddy_level lv[TOTLVLS];
+	struct buddy_shm_page *pg;
+	int fd, i;
+	if (TOTLVLS > BSHMMAXLVLS || b->shm != NULL) {
+		return -1;
+	}
+	fd = shm_open(name, O_RDWR|O_CREAT, 0644);
+	if (fd == -1) {
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(*pg)) == -1) {
+		close(fd);
+		return -1;
+	}
+	pg = (struct buddy_shm_page *)mmap(NULL, sizeof(*pg), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pg == MAP_FAILED) {
+		return -1;
+	}
+	buddy_allocator_levels(b, lv);
+	/* leave it odd so that a reader of a stale page retries till we're done */
+	__atomic_store_n(&pg->seq, pg->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	pg->levels = TOTLVLS;
+	pg->memsz = b->memsz;
+	pg->inuse = b->inuse;
+	pg->unused = b->unused;
+	pg->requested = b->requested;
+	for (i = 0; i < BSHMMAXLVLS; i++) {
+		pg->lvlfull[i] = i < TOTLVLS ? lv[i].full : 0;
+	}
+	pg->magic = BSHMMAGIC;
+	__atomic_store_n(&pg->seq, pg->seq + 1, __ATOMIC_RELEASE);
+	b->shm = pg;
+	return 0;
+}
+
+BUDAPI void
+buddy_allocator_shm_unpublish(buddy_allocator_t *b, const char *name)
+{
+	if (b->shm == NULL) {
+		return;
+	}
+	munmap(b->shm, sizeof(*b->shm));
+	b->shm = NULL;
+	if (name != NULL) {
+		shm_unlink(name);
+	}
+}
+
+#define BSHMTRIES (1L << 24)
+
+/* map a published page read only for buddy_shm_read() */
+BUDAPI const struct buddy_shm_page *
+buddy_shm_open(const char *name)
+{
+	struct buddy_shm_page *pg;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	pg = (struct buddy_shm_page *)mmap(NULL, sizeof(*pg), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return pg == MAP_FAILED ? NULL : pg;
+}
+
+BUDAPI void
+buddy_shm_close(const struct buddy_shm_page *pg)
+{
+	munmap((void *)pg, sizeof(*pg));
+}
+
+/*
+ * take a consistent copy of the page. returns -1 with EINVAL if it isn't a
+ * stats page, or with EAGAIN if the sequence never settled within
+ * BSHMTRIES loads, as when the publisher died halfway through an update.
+ */
+BUDAPI int
+buddy_shm_read(const struct buddy_shm_page *pg, struct buddy_shm_page *out)
+{
+	uint64_t s1, s2;
+	long tries = 0;
+	int i;
+	do {
+		while ((s1 = __atomic_load_n(&pg->seq, __ATOMIC_ACQUIRE)) & 1) {
+			if (++tries == BSHMTRIES) {
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+		out->magic = __atomic_load_n(&pg->magic, __ATOMIC_RELAXED);
+		out->levels = __atomic_load_n(&pg->levels, __ATOMIC_RELAXED);
+		out->memsz = __atomic_load_n(&pg->memsz, __ATOMIC_RELAXED);
+		out->inuse = __atomic_load_n(&pg->inuse, __ATOMIC_RELAXED);
+		out->unused = __atomic_load_n(&pg->unused, __ATOMIC_RELAXED);
+		out->requested = __atomic_load_n(&pg->requested, __ATOMIC_RELAXED);
+		for (i = 0; i < BSHMMAXLVLS; i++) {
+			out->lvlfull[i] = __atomic_load_n(&pg->lvlfull[i], __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&pg->seq, __ATOMIC_RELAXED);
+		if (s1 != s2 && ++tries == BSHMTRIES) {
+			errno = EAGAIN;
+			return -1;
+		}
+	} while (s1 != s2);
+	out->seq = s1;
+	if (out->magic != BSHMMAGIC || out->levels > BSHMMAXLVLS) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * generation tags. once enabled every allocation stamps the current epoch
+ * in a side table indexed by cell (4 bytes per cell) and the caller moves
+ * the epoch forward whenever it sees fit, e.g. once per request or per
+ * second. blocks that stay around for many epochs are the ones pinning
+ * big buddies and keeping them from merging. stale stamps of freed cells
+ * are never cleared, only full cells are reported.
+ */
+BUDAPI int
+buddy_allocator_epoch_enable(buddy_allocator_t *b)
+{
+	if (b->epochs == NULL) {
+		b->epochs = (uint32_t *)calloc(1L << TOTLVLS, sizeof(*b->epochs));
+		if (b->epochs == NULL) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+BUDAPI uint32_t
+buddy_allocator_epoch_advance(buddy_allocator_t *b)
+{
+	return ++b->epoch;
+}
+
+/* call cb for every live block stamped before epoch e, in cell order */
+BUDAPI void
+buddy_allocator_epoch_older(buddy_allocator_t *b, uint32_t e, buddy_epoch_cb cb, void *ctx)
+{
+	long cell;
+	int lvl = 1;
+	if (b->epochs == NULL) {
+		return;
+	}
+	for (cell = 1; cell < 1L << TOTLVLS; cell++) {
+		if (cell == 1L << lvl) {
+			lvl++;
+		}
+		if (b->epochs[cell] < e && ISFULL(b->bits, cell)) {
+			cb(ctx, walkoffset(b, lvl, cell), LVLSIZE(b, lvl), b->epochs[cell]);
+		}
+	}
+}
+
+#define BEPOCHSTAMP(b, cell) do { \
+	if ((b)->epochs != NULL) \
+		(b)->epochs[(cell)] = (b)->epoch; } while(0)
+
+/*
+ * the tree never touches the arena, it only hands out offsets into it.
+ * these are the calls the pointer api below is built on and they work
+ * just the same on an allocator created with a NULL memstart, which can
+ * then manage anything that is addressed by offset: file extents, device
+ * heaps, id ranges or simulated arenas that are never reserved.
+ */
+BUDAPI size_t
+buddy_offset_alloc(buddy_allocator_t *b, size_t sz)
+{
+	struct allocationInfo ret;
+	BSTATSTART(start);
+	switch (b->engine) {
+	case BUDDY_ENGINE_RECURSIVE:
+		ret = allocRecurse(b, sz, targetlevel(b->memsz, b->shift, sz), 1, 1);
+		break;
+	case BUDDY_ENGINE_FREEMAP:
+		ret = allocMap(b, sz, targetlevel(b->memsz, b->shift, sz));
+		break;
+	default:
+		ret = allocWalk(b, sz, targetlevel(b->memsz, b->shift, sz));
+		break;
+	}
+	if (ret.success) {
+		BSTATEND(BSTAT_ALLOC_OK, start);
+		BPROFALLOC(b, ret.offset, sz, ret.blocksz);
+		BSHMUPDATE(b, ret.lvl, 1);
+		BEPOCHSTAMP(b, ret.cell);
+		return ret.offset;
+	}
+	BSTATEND(BSTAT_ALLOC_FAIL, start);
+	return BUDDY_NOOFF;
+}
+
+/* returns 0 if off was the start of an allocated block, -1 otherwise */
+BUDAPI int
+buddy_offset_free(buddy_allocator_t *b, size_t off)
+{
+	struct freeInfo ret;
+	if (off >= b->memsz) {
+		return -1;
+	}
+	BSTATSTART(start);
+	switch (b->engine) {
+	case BUDDY_ENGINE_RECURSIVE:
+		ret = freeRecurse(b, off, 1, 1);
+		break;
+	case BUDDY_ENGINE_FREEMAP:
+		ret = freeMap(b, off);
+		break;
+	default:
+		ret = freeWalk(b, off);
+		break;
+	}
+	BSTATEND(BSTAT_FREE, start);
+	if (!ret.success) {
+		return -1;
+	}
+	BPROFFREE(b, off);
+	BSHMUPDATE(b, ret.lvl, -1);
+	return 0;
+}
+
+/*
+ * free when the caller still knows the size it asked for, like pmr and
+ * the stl allocators do. the size pins the level, so the cell of off on
+ * it is found without looking at the state of every cell on the way (in a
+ * power of two arena it is just off shifted down), and the merges go back
+ * up through the parents. a size that doesn't match the block at off is
+ * refused.
+ */
+BUDAPI int
+buddy_offset_free_sized(buddy_allocator_t *b, size_t off, size_t sz)
+{
+	long cell = 1;
+	size_t rel = off;
+	int lvl, l, freed;
+	if (off >= b->memsz || (lvl = targetlevel(b->memsz, b->shift, sz)) == 0) {
+		return -1;
+	}
+	BSTATSTART(start);
+	if (b->shift != 0) {
+		cell = (1L << (lvl-1)) + (long)(off >> (b->shift - (lvl-1)));
+		rel = off & (LVLSIZE(b, lvl) - 1);
+	} else {
+		for (l = 1; l < lvl; l++) {
+			if (rel < LVLSIZE(b, l+1)) {
+				cell = LEFTCHILD(cell);
+			} else {
+				rel -= LVLSIZE(b, l+1);
+				cell = RIGHTCHILD(cell);
+			}
+		}
+	}
+	if (rel != 0 || !ISFULL(b->bits, cell)) {
+		BSTATEND(BSTAT_FREE, start);
+		return -1;
+	}
+	b->inuse -= LVLSIZE(b, lvl);
+	b->unused += LVLSIZE(b, lvl);
+	freed = lvl;
+	if (b->freemap != NULL) {
+		fmrelease(b, lvl, cell);
+	} else {
+		FREECELL(b->bits, cell);
+		BPROBE(free, lvl, cell, off);
+		for (; lvl > 1; lvl--) {
+			cell >>= 1;
+			if (!ISFREE(b->bits, LEFTCHILD(cell)) || !ISFREE(b->bits, RIGHTCHILD(cell))) {
+				break;
+			}
+			FREECELL(b->bits, cell);
+			BPROBE(merge, lvl-1, cell, walkoffset(b, lvl-1, cell));
+		}
+	}
+	BSTATEND(BSTAT_FREE, start);
+	BPROFFREE(b, off);
+	BSHMUPDATE(b, freed, -1);
+	return 0;
+}
+
+/* size of the block allocated at off, 0 if off isn't the start of one */
+BUDAPI size_t
+buddy_offset_size(buddy_allocator_t *b, size_t off)
+{
+	size_t half;
+	long cell = 1;
+	int lvl;
+	for (lvl = 1; lvl <= TOTLVLS && off < b->memsz; lvl++) {
+		if (ISFULL(b->bits, cell)) {
+			return off == 0 ? LVLSIZE(b, lvl) : 0;
+		}
+		if (!ISSPLIT(b->bits, cell)) {
+			return 0;
+		}
+		half = LVLSIZE(b, lvl+1);
+		if (off < half) {
+			cell = LEFTCHILD(cell);
+		} else {
+			off -= half;
+			cell = RIGHTCHILD(cell);
+		}
+	}
+	return 0;
+}
+
+BUDAPI void *
+buddy_allocator_alloc(buddy_allocator_t *b, size_t sz)
+{
+	size_t off = buddy_offset_alloc(b, sz);
+	if (off == BUDDY_NOOFF) {
+		return NULL;
+	}
+	return (char *)b->memstart + off;
+}
+
+BUDAPI void
+buddy_allocator_free(buddy_allocator_t *b, void *ptr)
+{
+	if (ptr == NULL) {
+		fprintf(stderr, "free on null requested\n");
+		return;
+	} else if (ptr < b->memstart || ptr >= (void *)((char *)b->memstart + b->memsz)){
+		fprintf(stderr, "free on range not belonging to the allocator");
+		return;
+	}
+	buddy_offset_free(b, (char *)ptr - (char *)b->memstart);
+} 
+
+BUDAPI void
+buddy_allocator_free_sized(buddy_allocator_t *b, void *ptr, size_t sz)
+{
+	if (ptr == NULL) {
+		fprintf(stderr, "free on null requested\n");
+		return;
+	} else if (ptr < b->memstart || ptr >= (void *)((char *)b->memstart + b->memsz)){
+		fprintf(stderr, "free on range not belonging to the allocator");
+		return;
+	}
+	if (buddy_offset_free_sized(b, (char *)ptr - (char *)b->memstart, sz) == -1) {
+		fprintf(stderr, "sized free of %zd bytes doesn't match the block\n", sz);
+	}
+}
+
+BUDAPI void
+buddy_allocator_stats(buddy_allocator_t *b, struct buddy_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->memsz = b->memsz;
+	st->inuse = b->inuse;
+	st->unused = b->unused;
+	st->requested = b->requested;
+#ifdef BUDSTATS
+	struct bstat_thread *t;
+	int h, i;
+	for (t = __atomic_load_n(&bstat_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+		for (h = 0; h < BSTAT_NHIST; h++) {
+			for (i = 0; i < BSTATBUCKETS; i++) {
+				st->hist[h][i] += __atomic_load_n(&t->hist[h][i], __ATOMIC_RELAXED);
+			}
+		}
+	}
+#endif
+}
+
+BUDAPI void
+buddy_allocator_print_stats(buddy_allocator_t *b)
+{
+	static const char *names[BSTAT_NHIST] = { "alloc ok", "alloc fail", "free" };
+	struct buddy_stats st;
+	int h, i;
+	buddy_allocator_stats(b, &st);
+	printf("size:%zd\tinuse:%zd\trequested:%zd\tfree:%zd\n",
+		st.memsz, st.inuse, st.requested, st.unused);
+#ifndef BUDSTATS
+	printf("latency histograms not compiled in (build with make stats)\n");
+#endif
+	for (h = 0; h < BSTAT_NHIST; h++) {
+		for (i = 0; i < BSTATBUCKETS; i++) {
+			if (st.hist[h][i] != 0) {
+				printf("%-10s [2^%d cycles]\t%llu\n", names[h], i,
+					(unsigned long long)st.hist[h][i]);
+			}
+		}
+	}
+}
+
+BUDAPI void
+buddy_allocator_print(buddy_allocator_t *balloc)
+{
+	int bi;
+	printf("start @%p\tsize:%zd\tinuse:%zd\trequessted:%zd\tfree:%zd\n",
+		balloc->memstart, balloc->memsz, balloc->inuse, balloc->requested, balloc->unused);
+	for (bi = BITFIELDBYTES-1; bi >= 0; bi--) {
+		printf("[" BYTE_TO_BINARY_PATTERN "],", 
+			BYTE_TO_BINARY(balloc->bits[bi]));
+	} 
+	printf("\n");
+		
+}
+
+/*
+ * first full cell at or after cell on lvl, 0 if there is none. the two
+ * bits of a cell are adjacent and start on an even bit so a whole 64 bit
+ * word of cells is checked at once: w & (w >> 1) leaves the low bit of
+ * every 11 pair set. a level is one contiguous run of bits so free space
+ * goes by 32 cells per step without looking at each cell.
+ */
+static long
+nextfull(const unsigned char *bits, size_t bitbytes, int lvl, long cell)
+{
+	size_t p = 2*cell - 2, end = 2*(1UL << lvl) - 2, by, i, valid;
+	uint64_t w, m;
+	while (p < end) {
+		by = p/8;
+		w = 0;
+		for (i = 0; i < 8 && by + i < bitbytes; i++) {
+			w |= (uint64_t)bits[by + i] << (8*i);
+		}
+		w >>= p%8;
+		valid = 64 - p%8;
+		if (valid > end - p) {
+			valid = end - p;
+		}
+		if (valid < 64) {
+			w &= (1ULL << valid) - 1;
+		}
+		m = w & (w >> 1) & 0x5555555555555555ULL;
+		if (m != 0) {
+			return cell + __builtin_ctzll(m)/2;
+		}
+		p += valid;
+		cell += valid/2;
+	}
+	return 0;
+}
+
+/*
+ * visit every allocated block in address order. full cells only ever sit
+ * under split parents and they never overlap, so keeping one cursor per
+ * level and always taking the lowest offset among them yields the blocks
+ * sorted by address. cb returns non zero to stop the walk, which is then
+ * returned, 0 otherwise.
+ */
+BUDAPI int
+buddy_allocator_foreach(buddy_allocator_t *b, buddy_block_cb cb, void *ctx)
+{
+	long cur[TOTLVLS];
+	size_t off[TOTLVLS];
+	int lvl, best, r;
+	for (lvl = 1; lvl <= TOTLVLS; lvl++) {
+		cur[lvl-1] = nextfull(b->bits, BITFIELDBYTES, lvl, 1L << (lvl-1));
+		off[lvl-1] = cur[lvl-1] ? walkoffset(b, lvl, cur[lvl-1]) : 0;
+	}
+	for (;;) {
+		best = 0;
+		for (lvl = 1; lvl <= TOTLVLS; lvl++) {
+			if (cur[lvl-1] != 0 && (best == 0 || off[lvl-1] < off[best-1])) {
+				best = lvl;
+			}
+		}
+		if (best == 0) {
+			return 0;
+		}
+		if ((r = cb(ctx, off[best-1], LVLSIZE(b, best))) != 0) {
+			return r;
+		}
+		cur[best-1] = nextfull(b->bits, BITFIELDBYTES, best, cur[best-1] + 1);
+		off[best-1] = cur[best-1] ? walkoffset(b, best, cur[best-1]) : 0;
+	}
+}
+
+/*
+ * fill lv[0..TOTLVLS-1] with the state of the cells that are reachable,
+ * i.e. the root and every cell under a split parent. free therefore only
+ * counts blocks that could be handed out at that size right now. it only
+ * reads the tree so it is fine to call from a signal handler.
+ */
+BUDAPI void
+buddy_allocator_levels(buddy_allocator_t *b, struct buddy_level *lv)
+{
+	long cell, first;
+	int lvl;
+	for (lvl = 1; lvl <= TOTLVLS; lvl++) {
+		first = 1L << (lvl-1);
+		lv[lvl-1].blocksz = LVLSIZE(b, lvl);
+		lv[lvl-1].full = lv[lvl-1].split = lv[lvl-1].free = 0;
+		for (cell = first; cell < first << 1; cell++) {
+			if (cell != 1 && !ISSPLIT(b->bits, cell/2)) {
+				continue;
+			}
+			if (ISFULL(b->bits, cell)) {
+				lv[lvl-1].full++;
+			} else if (ISSPLIT(b->bits, cell)) {
+				lv[lvl-1].split++;
+			} else {
+				lv[lvl-1].free++;
+			}
+		}
+	}
+}
+
+static int
+writeall(int fd, const void *buf, size_t n)
+{
+	const char *p = (const char *)buf;
+	ssize_t w;
+	while (n > 0) {
+		w = write(fd, p, n);
+		if (w < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+/* write a snapshot of the tree to fd. only uses async signal safe calls. */
+BUDAPI int
+buddy_allocator_snapshot(buddy_allocator_t *b, int fd)
+{
+	struct buddy_snapshot_hdr h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BUDSNAPMAGIC, sizeof(h.magic));
+	h.levels = TOTLVLS;
+	h.bitbytes = BITFIELDBYTES;
+	h.memsz = b->memsz;
+	h.inuse = b->inuse;
+	h.unused = b->unused;
+	h.requested = b->requested;
+	if (writeall(fd, &h, sizeof(h)) == -1) {
+		return -1;
+	}
+	return writeall(fd, b->bits, BITFIELDBYTES);
+}
+
+/*
+ * printf is off limits in a signal handler so the report is built with
+ * this tiny buffered writer instead.
+ */
+struct sigwriter {
+	int fd;
+	size_t n;
+	char buf[512];
+};
+
+static void
+sw_flush(struct sigwriter *w)
+{
+	writeall(w->fd, w->buf, w->n);
+	w->n = 0;
+}
+
+static void
+sw_str(struct sigwriter *w, const char *str)
+{
+	for (; *str != '\0'; str++) {
+		if (w->n == sizeof(w->buf)) {
+			sw_flush(w);
+		}
+		w->buf[w->n++] = *str;
+	}
+}
+
+static void
+sw_num(struct sigwriter *w, uint64_t v)
+{
+	char tmp[21];
+	int i = sizeof(tmp) - 1;
+	tmp[i] = '\0';
+	do {
+		tmp[--i] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	sw_str(w, tmp + i);
+}
+
+static buddy_allocator_t *sigdump_b;
+static char *sigdump_path, *sigdump_snap;
+
+/*
+ * the tree is read without any locking so if the signal lands while the
+ * interrupted thread is halfway through an alloc or free the dump can be
+ * off by that one operation. good enough for looking at fragmentation.
+ */
+static void
+sigdump_handler(int signo)
+{
+	static const char *names[BSTAT_NHIST] = { "alloc_ok", "alloc_fail", "free" };
+	struct buddy_level lv[TOTLVLS];
+	struct buddy_stats st;
+	struct sigwriter w;
+	int saved = errno, fd, i, h;
+	(void)signo;
+	buddy_allocator_stats(sigdump_b, &st);
+	buddy_allocator_levels(sigdump_b, lv);
+	w.fd = open(sigdump_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	w.n = 0;
+	if (w.fd != -1) {
+		sw_str(&w, "size ");       sw_num(&w, st.memsz);
+		sw_str(&w, "\ninuse ");    sw_num(&w, st.inuse);
+		sw_str(&w, "\nrequested "); sw_num(&w, st.requested);
+		sw_str(&w, "\nfree ");     sw_num(&w, st.unused);
+		sw_str(&w, "\n");
+		for (i = 0; i < TOTLVLS; i++) {
+			sw_str(&w, "level ");   sw_num(&w, i+1);
+			sw_str(&w, " blocksz "); sw_num(&w, lv[i].blocksz);
+			sw_str(&w, " full ");   sw_num(&w, lv[i].full);
+			sw_str(&w, " split ");  sw_num(&w, lv[i].split);
+			sw_str(&w, " free ");   sw_num(&w, lv[i].free);
+			sw_str(&w, "\n");
+		}
+		for (h = 0; h < BSTAT_NHIST; h++) {
+			for (i = 0; i < BSTATBUCKETS; i++) {
+				if (st.hist[h][i] != 0) {
+					sw_str(&w, names[h]); sw_str(&w, " 2^");
+					sw_num(&w, i);        sw_str(&w, " ");
+					sw_num(&w, st.hist[h][i]);
+					sw_str(&w, "\n");
+				}
+			}
+		}
+		sw_flush(&w);
+		close(w.fd);
+	}
+	if (sigdump_snap != NULL) {
+		fd = open(sigdump_snap, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd != -1) {
+			buddy_allocator_snapshot(sigdump_b, fd);
+			close(fd);
+		}
+	}
+	errno = saved;
+}
+
+/*
+ * on signo write the stats and per level occupancy of b to path and if
+ * withsnap is set also a snapshot of the tree to path.snap. only one
+ * allocator per process can be hooked up, installing again replaces it.
+ */
+BUDAPI int
+buddy_allocator_sigdump(buddy_allocator_t *b, int signo, const char *path, bool withsnap)
+{
+	struct sigaction sa;
+	char *p, *snap = NULL;
+	size_t len = strlen(path);
+	if ((p = strdup(path)) == NULL) {
+		return -1;
+	}
+	if (withsnap) {
+		if ((snap = (char *)malloc(len + sizeof(".snap"))) == NULL) {
+			free(p);
+			return -1;
+		}
+		memcpy(snap, path, len);
+		memcpy(snap + len, ".snap", sizeof(".snap"));
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigdump_handler;
+	sa.sa_flags = SA_RESTART;
+	sigfillset(&sa.sa_mask);
+	/* keep the handler away while we swap the globals under it */
+	signal(signo, SIG_IGN);
+	free(sigdump_path);
+	free(sigdump_snap);
+	sigdump_b = b;
+	sigdump_path = p;
+	sigdump_snap = snap;
+	return sigaction(signo, &sa, NULL);
+}
+
+/*
+ * extent allocator over a preallocated file. the file starts with a page
+ * aligned header holding a snapshot of the tree, the extents come after
+ * it and are handed out by an offset only allocator. extents freed that
+ * are at least punchmin bytes get their blocks punched out so the space
+ * goes back to the filesystem, the file size stays the same. the header
+ * is only rewritten by buddy_file_sync() and buddy_file_close(), after a
+ * crash the file comes back as it was at the last sync.
+ */
+#define BUDFILEMAGIC "BUDFILE1"
+struct buddy_file_hdr {
+	char magic[8];
+	uint64_t dataoff;
+	uint64_t punchmin;
+	struct buddy_snapshot_hdr snap;
+};
+
+struct buddy_file {
+	int fd;
+	size_t dataoff;
+	size_t punchmin;
+	buddy_allocator_t *b;
+};
+
+static size_t
+bfile_hdrsz(void)
+{
+	size_t pg = sysconf(_SC_PAGESIZE);
+	return (sizeof(struct buddy_file_hdr) + BITFIELDBYTES + pg - 1) / pg * pg;
+}
+
+/*
+ * read the header back. the geometry has to be the one of this build and
+ * the extents it describes have to fit in the file, or a truncated or
+ * foreign file would hand out offsets past its end.
+ */
+static int
+bfile_load(buddy_file_t *f)
+{
+	struct buddy_file_hdr h;
+	struct stat st;
+	if (pread(f->fd, &h, sizeof(h), 0) != sizeof(h) || fstat(f->fd, &st) == -1 ||
+	    memcmp(h.magic, BUDFILEMAGIC, sizeof(h.magic)) != 0 ||
+	    memcmp(h.snap.magic, BUDSNAPMAGIC, sizeof(h.snap.magic)) != 0 ||
+	    h.snap.levels != TOTLVLS || h.snap.bitbytes != BITFIELDBYTES ||
+	    h.dataoff != bfile_hdrsz() || h.snap.memsz == 0 ||
+	    (uint64_t)st.st_size < h.dataoff || h.snap.memsz > (uint64_t)st.st_size - h.dataoff ||
+	    h.snap.inuse > h.snap.memsz || h.snap.inuse + h.snap.unused != h.snap.memsz) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((f->b = buddy_allocator_create(NULL, h.snap.memsz)) == NULL) {
+		return -1;
+	}
+	if (pread(f->fd, f->b->bits, BITFIELDBYTES, sizeof(h)) != BITFIELDBYTES) {
+		errno = EINVAL;
+		return -1;
+	}
+	f->b->inuse = h.snap.inuse;
+	f->b->unused = h.snap.unused;
+	f->b->requested = h.snap.requested;
+	f->dataoff = h.dataoff;
+	f->punchmin = h.punchmin;
+	return 0;
+}
+
+/* write the tree out to the header and flush everything to disk */
+BUDAPI int
+buddy_file_sync(buddy_file_t *f)
+{
+	struct buddy_file_hdr h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BUDFILEMAGIC, sizeof(h.magic));
+	h.dataoff = f->dataoff;
+	h.punchmin = f->punchmin;
+	if (lseek(f->fd, offsetof(struct buddy_file_hdr, snap), SEEK_SET) == -1 ||
+	    buddy_allocator_snapshot(f->b, f->fd) == -1 ||
+	    pwrite(f->fd, &h, offsetof(struct buddy_file_hdr, snap), 0) !=
+	    offsetof(struct buddy_file_hdr, snap)) {
+		return -1;
+	}
+	return fdatasync(f->fd);
+}
+
+/*
+ * open the extent file at path, or create it with room for datasz bytes
+ * of extents if it doesn't exist. datasz and punchmin are ignored for an
+ * existing file, they come from its header and the geometry has to match
+ * TOTLVLS.
+ */
+BUDAPI buddy_file_t *
+buddy_file_open(const char *path, size_t datasz, size_t punchmin)
+{
+	buddy_file_t *f = (buddy_file_t *)calloc(1, sizeof(*f));
+	int saved;
+	if (f == NULL) {
+		return NULL;
+	}
+	f->punchmin = punchmin;
+	if ((f->fd = open(path, O_RDWR)) != -1) {
+		if (bfile_load(f) == -1) {
+			goto fail;
+		}
+		return f;
+	}
+	if (errno != ENOENT || (f->fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0644)) == -1) {
+		goto fail;
+	}
+	f->dataoff = bfile_hdrsz();
+	if ((f->b = buddy_allocator_create(NULL, datasz)) == NULL) {
+		goto fail;
+	}
+	/* not every filesystem can preallocate, a sparse file does the job too */
+	if (fallocate(f->fd, 0, 0, f->dataoff + datasz) == -1 &&
+	    ftruncate(f->fd, f->dataoff + datasz) == -1) {
+		goto fail;
+	}
+	if (buddy_file_sync(f) == -1) {
+		goto fail;
+	}
+	return f;
+fail:
+	saved = errno;
+	if (f->fd != -1) {
+		close(f->fd);
+	}
+	buddy_allocator_destroy(f->b);
+	free(f);
+	errno = saved;
+	return NULL;
+}
+
+BUDAPI int
+buddy_file_close(buddy_file_t *f)
+{
+	int ret = buddy_file_sync(f);
+	close(f->fd);
+	buddy_allocator_destroy(f->b);
+	free(f);
+	return ret;
+}
+
+/* file offset of a new extent of at least sz bytes, BUDDY_NOOFF if full */
+BUDAPI size_t
+buddy_file_alloc(buddy_file_t *f, size_t sz)
+{
+	size_t off = buddy_offset_alloc(f->b, sz);
+	return off == BUDDY_NOOFF ? off : f->dataoff + off;
+}
+
+BUDAPI int
+buddy_file_free(buddy_file_t *f, size_t foff)
+{
+	size_t off = foff - f->dataoff, sz;
+	if (foff < f->dataoff || (sz = buddy_offset_size(f->b, off)) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	buddy_offset_free(f->b, off);
+	if (f->punchmin != 0 && sz >= f->punchmin) {
+		/* best effort, the extent is free either way */
+		fallocate(f->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, foff, sz);
+	}
+	return 0;
+}
+
+/* 
+ * pread/pwrite that stay inside the extent area and don't return short
+ * unless they hit an error.
+ */
+BUDAPI ssize_t
+buddy_file_pread(buddy_file_t *f, void *buf, size_t len, size_t foff)
+{
+	size_t done = 0;
+	ssize_t r;
+	if (foff < f->dataoff || foff - f->dataoff > f->b->memsz ||
+	    len > f->b->memsz - (foff - f->dataoff)) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (done < len) {
+		r = pread(f->fd, (char *)buf + done, len - done, foff + done);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return done ? (ssize_t)done : r;
+		}
+		done += r;
+	}
+	return done;
+}
+
+BUDAPI ssize_t
+buddy_file_pwrite(buddy_file_t *f, const void *buf, size_t len, size_t foff)
+{
+	size_t done = 0;
+	ssize_t r;
+	if (foff < f->dataoff || foff - f->dataoff > f->b->memsz ||
+	    len > f->b->memsz - (foff - f->dataoff)) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (done < len) {
+		r = pwrite(f->fd, (const char *)buf + done, len - done, foff + done);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return done ? (ssize_t)done : r;
+		}
+		done += r;
+	}
+	return done;
+}
+
+/*
+ * allocator shared between processes. the header with the allocator and
+ * its bits and the arena all live in one shared mapping (a named posix shm
+ * object, or a memfd that is passed on by fork or over a unix socket) that
+ * every process maps wherever it likes. nothing in it is a pointer, blocks
+ * are handed around by offset and turned into local pointers with
+ * buddy_shared_ptr(). the tree is protected by a robust process shared
+ * mutex, if a process dies holding it the next one to take it repairs
+ * whatever alloc or free was cut short. hooks that keep private pointers
+ * in the allocator (prof, shm stats, epochs) can't be used on it.
+ */
+#define BSHAREDMAGIC 0x4255445348524431ULL /* BUDSHRD1 */
+struct buddy_shared_hdr {
+	uint64_t magic;
+	uint32_t levels;
+	uint32_t recoveries;
+	uint64_t mapsz, arenaoff;
+	/* the counters from before the last alloc or free, see bshared_lock() */
+	uint64_t jinuse, jrequested, jsz;
+	pthread_mutex_t lock;
+	buddy_allocator_t b;
+};
+
+struct buddy_shared {
+	int fd;
+	size_t mapsz;
+	struct buddy_shared_hdr *hdr;
+	char *arena;
+};
+
+/* mark cell and everything below it free */
+static void
+bshared_clear(buddy_allocator_t *b, long cell, int lvl)
+{
+	if (lvl > TOTLVLS) {
+		return;
+	}
+	FREECELL(b->bits, cell);
+	bshared_clear(b, LEFTCHILD(cell), lvl+1);
+	bshared_clear(b, RIGHTCHILD(cell), lvl+1);
+}
+
+/* 
+ * put a subtree back into a state a whole alloc or free would have left
+ * it in: split cells whose halves are both free get merged and anything
+ * below a free cell, i.e. a block marked full by an alloc that didn't get
+ * to split its parents, is dropped however deep it sits. returns whether
+ * cell is free now.
+ */
+static bool
+bshared_repair(buddy_allocator_t *b, long cell, int lvl)
+{
+	bool lfree, rfree;
+	if (lvl > TOTLVLS || ISFULL(b->bits, cell)) {
+		return lvl > TOTLVLS;
+	}
+	if (ISFREE(b->bits, cell)) {
+		bshared_clear(b, LEFTCHILD(cell), lvl+1);
+		bshared_clear(b, RIGHTCHILD(cell), lvl+1);
+		return true;
+	}
+	lfree = bshared_repair(b, LEFTCHILD(cell), lvl+1);
+	rfree = bshared_repair(b, RIGHTCHILD(cell), lvl+1);
+	if (lfree && rfree) {
+		FREECELL(b->bits, cell);
+		return true;
+	}
+	return false;
+}
+
+static int
+bshared_count(void *ctx, size_t offset, size_t size)
+{
+	(void)offset;
+	*(size_t *)ctx += size;
+	return 0;
+}
+
+/*
+ * requested is a running total the tree knows nothing about, so the
+ * repair puts back the value from before the alloc or free that was cut
+ * short and adds that request only if its block survived, i.e. inuse
+ * moved. the journal is written under the lock before every alloc and
+ * free, a free leaves requested alone and notes a size of 0.
+ */
+static int
+bshared_lock(buddy_shared_t *s, size_t sz)
+{
+	struct buddy_shared_hdr *h = s->hdr;
+	buddy_allocator_t *b = &h->b;
+	size_t inuse = 0;
+	int r = pthread_mutex_lock(&h->lock);
+	if (r == EOWNERDEAD) {
+		bshared_repair(b, 1, 1);
+		buddy_allocator_foreach(b, bshared_count, &inuse);
+		b->inuse = inuse;
+		b->unused = b->memsz - inuse;
+		b->requested = h->jrequested + (inuse != h->jinuse ? h->jsz : 0);
+		h->recoveries++;
+		r = pthread_mutex_consistent(&h->lock);
+	}
+	if (r == 0) {
+		h->jinuse = b->inuse;
+		h->jrequested = b->requested;
+		h->jsz = sz;
+		/* the journal has to be written before the tree is touched */
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	}
+	return r;
+}
+
+static buddy_shared_t *
+bshared_map(int fd, size_t mapsz)
+{
+	buddy_shared_t *s = (buddy_shared_t *)calloc(1, sizeof(*s));
+	void *m;
+	if (s == NULL) {
+		return NULL;
+	}
+	m = mmap(NULL, mapsz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		free(s);
+		return NULL;
+	}
+	s->fd = fd;
+	s->mapsz = mapsz;
+	s->hdr = (struct buddy_shared_hdr *)m;
+	return s;
+}
+
+/*
+ * create a shared allocator with an arena of arenasz bytes in the posix
+ * shm object name, or in an anonymous memfd if name is NULL.
+ */
+BUDAPI buddy_shared_t *
+buddy_shared_create(const char *name, size_t arenasz)
+{
+	pthread_mutexattr_t ma;
+	buddy_shared_t *s;
+	size_t pg = sysconf(_SC_PAGESIZE);
+	size_t arenaoff = (sizeof(struct buddy_shared_hdr) + pg - 1) / pg * pg;
+	int fd, saved;
+	fd = name == NULL ? memfd_create("budalloc", 0) :
+	    shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (ftruncate(fd, arenaoff + arenasz) == -1 ||
+	    (s = bshared_map(fd, arenaoff + arenasz)) == NULL) {
+		saved = errno;
+		close(fd);
+		if (name != NULL) {
+			shm_unlink(name);
+		}
+		errno = saved;
+		return NULL;
+	}
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&s->hdr->lock, &ma);
+	pthread_mutexattr_destroy(&ma);
+	buddy_allocator_init(&s->hdr->b, NULL, arenasz);
+	s->hdr->levels = TOTLVLS;
+	s->hdr->mapsz = s->mapsz;
+	s->hdr->arenaoff = arenaoff;
+	s->arena = (char *)s->hdr + arenaoff;
+	/* attachers only trust the header once the magic is there */
+	__atomic_store_n(&s->hdr->magic, BSHAREDMAGIC, __ATOMIC_RELEASE);
+	return s;
+}
+
+/* attach to a shared allocator through an fd, which is kept by s */
+BUDAPI buddy_shared_t *
+buddy_shared_attach_fd(int fd)
+{
+	struct buddy_shared_hdr *h;
+	buddy_shared_t *s;
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		return NULL;
+	}
+	if ((size_t)st.st_size < sizeof(*h)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((s = bshared_map(fd, st.st_size)) == NULL) {
+		return NULL;
+	}
+	h = s->hdr;
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != BSHAREDMAGIC ||
+	    h->levels != TOTLVLS || h->mapsz != s->mapsz) {
+		munmap(h, s->mapsz);
+		free(s);
+		errno = EINVAL;
+		return NULL;
+	}
+	s->arena = (char *)h + h->arenaoff;
+	return s;
+}
+
+BUDAPI buddy_shared_t *
+buddy_shared_attach(const char *name)
+{
+	buddy_shared_t *s;
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	if ((s = buddy_shared_attach_fd(fd)) == NULL) {
+		close(fd);
+	}
+	return s;
+}
+
+/* unmap and close, the allocator itself lives on in the other processes */
+BUDAPI void
+buddy_shared_detach(buddy_shared_t *s)
+{
+	munmap(s->hdr, s->mapsz);
+	close(s->fd);
+	free(s);
+}
+
+BUDAPI int
+buddy_shared_fd(buddy_shared_t *s)
+{
+	return s->fd;
+}
+
+BUDAPI size_t
+buddy_shared_alloc(buddy_shared_t *s, size_t sz)
+{
+	size_t off;
+	if (bshared_lock(s, sz) != 0) {
+		return BUDDY_NOOFF;
+	}
+	off = buddy_offset_alloc(&s->hdr->b, sz);
+	pthread_mutex_unlock(&s->hdr->lock);
+	return off;
+}
+
+BUDAPI int
+buddy_shared_free(buddy_shared_t *s, size_t off)
+{
+	int r;
+	if (bshared_lock(s, 0) != 0) {
+		return -1;
+	}
+	r = buddy_offset_free(&s->hdr->b, off);
+	pthread_mutex_unlock(&s->hdr->lock);
+	return r;
+}
+
+BUDAPI void *
+buddy_shared_ptr(buddy_shared_t *s, size_t off)
+{
+	return off == BUDDY_NOOFF ? NULL : s->arena + off;
+}
+
+BUDAPI size_t
+buddy_shared_off(buddy_shared_t *s, const void *p)
+{
+	return p == NULL ? BUDDY_NOOFF : (size_t)((const char *)p - s->arena);
+}
+
+/*
+ * the compact tree stores one bit per cell, cell c is bit c. on the last
+ * level the bit says full. above it the bit says split, and a cell that
+ * isn't split has nothing in use below it, so the bit of its left child
+ * is free to say whether the cell itself is full. a bit is only ever read
+ * on the way down from the root, under a parent known to be split, which
+ * is what makes the borrowed bits unambiguous. everything below a cell
+ * that isn't split stays 0 apart from that flag, so splitting a free cell
+ * only sets its own bit and merging only clears it.
+ *
+ * that halves the tree without the free lists the classic xor pair bit
+ * needs to find a free block, which would have to live in the arena. the
+ * walks are those of the iterative engine with the state decoded on the
+ * fly, blocks land exactly where a buddy_allocator_t would put them.
+ */
+enum { CFREE, CSPLIT = 2, CFULL };
+
+static inline int
+cstate(buddy_compact_t *c, int lvl, long cell)
+{
+	if (TESTBIT(c->bits, cell)) {
+		return lvl == TOTLVLS ? CFULL : CSPLIT;
+	}
+	if (lvl < TOTLVLS && TESTBIT(c->bits, LEFTCHILD(cell))) {
+		return CFULL;
+	}
+	return CFREE;
+}
+
+static inline void
+cfull(buddy_compact_t *c, int lvl, long cell)
+{
+	SETBIT(c->bits, lvl == TOTLVLS ? cell : LEFTCHILD(cell));
+}
+
+/* a full cell or a split one whose halves are both free becomes free */
+static inline void
+cclear(buddy_compact_t *c, int lvl, long cell)
+{
+	CLEARBIT(c->bits, cell);
+	if (lvl < TOTLVLS) {
+		CLEARBIT(c->bits, LEFTCHILD(cell));
+	}
+}
+
+BUDAPI void
+buddy_compact_init(buddy_compact_t *c, size_t memsz)
+{
+	memset(c, 0, sizeof(*c));
+	c->memsz = memsz;
+	c->unused = memsz;
+	if (memsz >= 1UL << (TOTLVLS-1) && (memsz & (memsz - 1)) == 0) {
+		c->shift = __builtin_ctzll(memsz);
+	}
+}
+
+BUDAPI size_t
+buddy_compact_alloc(buddy_compact_t *c, size_t sz)
+{
+	size_t off = 0;
+	long cell = 1;
+	int lvl = 1, tlvl = targetlevel(c->memsz, c->shift, sz), s;
+	if (tlvl == 0) {
+		return BUDDY_NOOFF;
+	}
+	for (;;) {
+		s = cstate(c, lvl, cell);
+		if (s == CFREE) {
+			cell <<= tlvl - lvl;
+			lvl = tlvl;
+			break;
+		}
+		if (s == CSPLIT && lvl < tlvl) {
+			cell = LEFTCHILD(cell);
+			lvl++;
+			continue;
+		}
+		for (; cell & 1; cell >>= 1, lvl--) {
+			if (cell == 1) {
+				return BUDDY_NOOFF;
+			}
+			off -= LVLSIZE(c, lvl);
+		}
+		cell++;
+		off += LVLSIZE(c, lvl);
+	}
+	cfull(c, lvl, cell);
+	c->requested += sz;
+	c->inuse += LVLSIZE(c, lvl);
+	c->unused -= LVLSIZE(c, lvl);
+	/* above the first split ancestor everything is split already */
+	while ((cell >>= 1) != 0 && !TESTBIT(c->bits, cell)) {
+		SETBIT(c->bits, cell);
+	}
+	return off;
+}
+
+/* free the full cell on lvl and merge up while both halves are free */
+static void
+crelease(buddy_compact_t *c, int lvl, long cell)
+{
+	cclear(c, lvl, cell);
+	c->inuse -= LVLSIZE(c, lvl);
+	c->unused += LVLSIZE(c, lvl);
+	for (; lvl > 1; lvl--) {
+		cell >>= 1;
+		if (cstate(c, lvl, LEFTCHILD(cell)) != CFREE || cstate(c, lvl, RIGHTCHILD(cell)) != CFREE) {
+			break;
+		}
+		cclear(c, lvl-1, cell);
+	}
+}
+
+BUDAPI int
+buddy_compact_free(buddy_compact_t *c, size_t off)
+{
+	long cell = 1;
+	int lvl, s;
+	if (off >= c->memsz) {
+		return -1;
+	}
+	for (lvl = 1; (s = cstate(c, lvl, cell)) != CFULL; lvl++) {
+		if (s != CSPLIT) {
+			return -1;
+		}
+		if (off < LVLSIZE(c, lvl+1)) {
+			cell = LEFTCHILD(cell);
+		} else {
+			off -= LVLSIZE(c, lvl+1);
+			cell = RIGHTCHILD(cell);
+		}
+	}
+	if (off != 0) {
+		return -1;
+	}
+	crelease(c, lvl, cell);
+	return 0;
+}
+
+/*
+ * like buddy_offset_free_sized(). the bit of a cell only means something
+ * under split parents, so unlike there every ancestor has to be checked.
+ */
+BUDAPI int
+buddy_compact_free_sized(buddy_compact_t *c, size_t off, size_t sz)
+{
+	long cell = 1, a;
+	size_t rel = off;
+	int lvl, l;
+	if (off >= c->memsz || (lvl = targetlevel(c->memsz, c->shift, sz)) == 0) {
+		return -1;
+	}
+	if (c->shift != 0) {
+		cell = (1L << (lvl-1)) + (long)(off >> (c->shift - (lvl-1)));
+		rel = off & (LVLSIZE(c, lvl) - 1);
+	} else {
+		for (l = 1; l < lvl; l++) {
+			if (rel < LVLSIZE(c, l+1)) {
+				cell = LEFTCHILD(cell);
+			} else {
+				rel -= LVLSIZE(c, l+1);
+				cell = RIGHTCHILD(cell);
+			}
+		}
+	}
+	if (rel != 0) {
+		return -1;
+	}
+	for (a = cell >> 1; a != 0; a >>= 1) {
+		if (!TESTBIT(c->bits, a)) {
+			return -1;
+		}
+	}
+	if (cstate(c, lvl, cell) != CFULL) {
+		return -1;
+	}
+	crelease(c, lvl, cell);
+	return 0;
+}
+
+/*
+ * write the tree of c into b as a buddy_allocator_t holds it, so the
+ * snapshot, foreach and print tools work on it. b ends up without an arena.
+ */
+BUDAPI void
+buddy_compact_expand(buddy_compact_t *c, buddy_allocator_t *b)
+{
+	long cell;
+	int lvl;
+	buddy_allocator_init(b, NULL, c->memsz);
+	b->inuse = c->inuse;
+	b->unused = c->unused;
+	b->requested = c->requested;
+	for (lvl = 1; lvl <= TOTLVLS; lvl++) {
+		for (cell = 1L << (lvl-1); cell < 1L << lvl; cell++) {
+			if (cell != 1 && !ISSPLIT(b->bits, cell >> 1)) {
+				continue;
+			}
+			switch (cstate(c, lvl, cell)) {
+			case CSPLIT:
+				ALLOCSPLIT(b->bits, cell);
+				break;
+			case CFULL:
+				ALLOCCELL(b->bits, cell);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * concurrent allocator. the tree is cut at level k into 2^(k-1) subtrees,
+ * one under each cell of that level, and every subtree has its own lock.
+ * a request that fits in a subtree is walked under the lock of that
+ * subtree alone. the top lock, which covers the k-1 levels above the cut,
+ * is only taken when the root of a subtree turns from free to in use or
+ * back, which is when a split or a merge crosses the cut, and for blocks
+ * bigger than a subtree.
+ *
+ * while the root of a subtree is in use all of its ancestors are split and
+ * stay split: the top levels only merge over a free root, and a root only
+ * leaves free with the top lock held. locks are taken subtree first, then
+ * top. neighbouring subtrees keep their cells in the same bytes, so the
+ * cells are read and written here with byte atomics. each thread starts
+ * looking in the subtree it last allocated from, which spreads threads
+ * over the subtrees. placement is first fit within a subtree, not over the
+ * whole tree, and a big block can miss space whose merge is still waiting
+ * for the top lock. the hooks that assume a single writer (prof, shm
+ * stats, epochs) are not run.
+ *
+ * a free from a thread whose subtree isn't the one of the block doesn't
+ * take the lock, it is pushed on a lock free list of pending frees of that
+ * subtree. the list is linked through the first bytes of the freed blocks,
+ * so it needs an arena whose smallest block holds a size_t, without one
+ * every free takes the lock. before it writes the link the free turns the
+ * cell of the block from full to held (01, unused by the tree otherwise)
+ * with a cas, so only the start of a block in use ever gets linked and a
+ * second free of the same block is refused. whoever takes the lock of the
+ * subtree next frees the whole list in one batch. until then the blocks
+ * still count as in use, but an alloc only fails after it went through
+ * every subtree. the home subtree of a thread is kept per allocator.
+ *
+ * on x86-64 linux with rseq (unless built with BUDNORSEQ) every cpu also
+ * caches up to BCPUCACHEN freed blocks of each size up to BCPUCACHEMAX.
+ * alloc pops and free pushes them in a restartable sequence, which the
+ * kernel restarts if the thread is preempted or migrated in the middle, so
+ * the lists need no locks and stay small however many threads there are.
+ * a free only looks up the level of the block, without a lock since the
+ * path to a live block doesn't change, and marks its cell held like a
+ * pending free does, which refuses a second free of a cached block. the
+ * alloc that takes it from the cache marks it full again. an alloc that
+ * finds nothing flushes the cache of its cpu into the tree before it
+ * gives up. threads the kernel couldn't register rseq for go to the tree.
+ * any thread can take the cache of another cpu: it sets the stop flag of
+ * that cpu, which the sequences check and then leave the list alone, and
+ * a membarrier restarts the ones that were already past the check. the
+ * cache is only used if the process could register for that membarrier.
+ *
+ * buddy_concurrent_alloc_wait() sleeps on a futex per level until a free
+ * leaves a block its request fits in. every free wakes one waiter on each
+ * level the merged block can serve, and a waiter that gets its block
+ * passes the wakeup on to the next one on its level in case there is
+ * more room. while anyone waits, frees skip the cpu caches and frees that
+ * went to a pending list, or to a cache just before the waiter came, are
+ * put back into the tree right away so they are seen. a waiter drains
+ * what the lists and the caches of all cpus held before it came with
+ * buddy_concurrent_drain() once before its first sleep.
+ */
+#if !defined(BUDNORSEQ) && defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <linux/membarrier.h>
+#define BUDRSEQ 1
+#endif
+#endif
+#define BCPUCACHEN   16
+#define BCPUCACHEMAX 4096
+/*
+ * cache line the per cpu and per subtree structs are aligned to, their
+ * sizes are multiples of it but not always powers of two, so it is also
+ * what their arrays are allocated with
+ */
+#define BCONLINE     64
+
+struct bconcpu {
+	void *head[TOTLVLS+1];
+	uint32_t stop;
+} __attribute__((aligned(BCONLINE)));
+
+struct bconsub {
+	pthread_mutex_t m;
+	size_t pending __attribute__((aligned(BCONLINE)));
+} __attribute__((aligned(BCONLINE)));
+
+struct buddy_concurrent {
+	buddy_allocator_t b;
+	int k;
+	bool remote;
+	long nsub, next;
+	pthread_key_t home;
+	pthread_mutex_t top;
+	struct bconsub *sub;
+	int ncpu;
+	struct bconcpu *cpus;
+	pthread_mutex_t steal;
+	uint32_t waiters;
+	struct {
+		uint32_t seq, n;
+	} wait[TOTLVLS+1];
+};
+
+/* a full block on a pending list or in a cpu cache */
+enum { CHELD = 1 };
+
+/* the 2 bit cell read as a number is CFREE, CHELD, CSPLIT or CFULL */
+static inline int
+astate(unsigned char *bits, long cell)
+{
+	return (__atomic_load_n(&bits[(2*cell-2)/8], __ATOMIC_RELAXED) >> ((2*cell-2)%8)) & 3;
+}
+
+static inline void
+aset(unsigned char *bits, long cell, int s)
+{
+	unsigned char *p = &bits[(2*cell-2)/8];
+	unsigned char o = __atomic_load_n(p, __ATOMIC_RELAXED), n;
+	int sh = (2*cell-2)%8;
+	do {
+		n = (o & ~(3 << sh)) | (s << sh);
+	} while (!__atomic_compare_exchange_n(p, &o, n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* set the cell to s if it is in state from, false if it wasn't */
+static inline bool
+acas(unsigned char *bits, long cell, int from, int s)
+{
+	unsigned char *p = &bits[(2*cell-2)/8];
+	unsigned char o = __atomic_load_n(p, __ATOMIC_RELAXED), n;
+	int sh = (2*cell-2)%8;
+	do {
+		if (((o >> sh) & 3) != from) {
+			return false;
+		}
+		n = (o & ~(3 << sh)) | (s << sh);
+	} while (!__atomic_compare_exchange_n(p, &o, n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return true;
+}
+
+/*
+ * allocWalk confined to the subtree under root, which is on rlvl. returns
+ * the cell it took on tlvl, 0 if the subtree had no room.
+ */
+static long
+cwalk(unsigned char *bits, long root, int rlvl, int tlvl)
+{
+	long cell = root, a;
+	int lvl = rlvl, s;
+	for (;;) {
+		s = astate(bits, cell);
+		if (s == CFREE) {
+			cell <<= tlvl - lvl;
+			break;
+		}
+		if (s == CSPLIT && lvl < tlvl) {
+			cell = LEFTCHILD(cell);
+			lvl++;
+			continue;
+		}
+		for (; cell != root && (cell & 1); cell >>= 1, lvl--)
+			;
+		if (cell == root) {
+			return 0;
+		}
+		cell++;
+	}
+	aset(bits, cell, CFULL);
+	for (a = cell >> 1, lvl = tlvl; lvl > rlvl && astate(bits, a) == CFREE; a >>= 1, lvl--) {
+		aset(bits, a, CSPLIT);
+	}
+	return cell;
+}
+
+/* merge the free cell on lvl up while its buddy is free, not above stop */
+static int
+cmerge(unsigned char *bits, long cell, int lvl, int stop)
+{
+	for (; lvl > stop && astate(bits, cell ^ 1) == CFREE; lvl--) {
+		cell >>= 1;
+		aset(bits, cell, CFREE);
+	}
+	return lvl;
+}
+
+/*
+ * the cell in state want (CFULL or CHELD) at rel under cell, looking no
+ * deeper than level last. leaves its level in lvl, returns 0 if there is
+ * none.
+ */
+static long
+cfind(buddy_allocator_t *b, long cell, int *lvl, int last, size_t rel, int want)
+{
+	int s;
+	for (; *lvl <= last; (*lvl)++) {
+		if ((s = astate(b->bits, cell)) == want) {
+			return rel == 0 ? cell : 0;
+		}
+		if (s != CSPLIT || *lvl == last) {
+			return 0;
+		}
+		if (rel < LVLSIZE(b, *lvl+1)) {
+			cell = LEFTCHILD(cell);
+		} else {
+			rel -= LVLSIZE(b, *lvl+1);
+			cell = RIGHTCHILD(cell);
+		}
+	}
+	return 0;
+}
+
+/* the cell on lvl that covers off, and off relative to its block */
+static long
+ccellat(buddy_allocator_t *b, size_t off, int lvl, size_t *rel)
+{
+	long cell = 1;
+	int l;
+	if (b->shift != 0) {
+		*rel = off & (LVLSIZE(b, lvl) - 1);
+		return (1L << (lvl-1)) + (long)(off >> (b->shift - (lvl-1)));
+	}
+	for (l = 1; l < lvl; l++) {
+		if (off < LVLSIZE(b, l+1)) {
+			cell = LEFTCHILD(cell);
+		} else {
+			off -= LVLSIZE(b, l+1);
+			cell = RIGHTCHILD(cell);
+		}
+	}
+	*rel = off;
+	return cell;
+}
+
+/*
+ * wake a waiter on each level from lvl to last. a block that came free on
+ * lvl can serve every size up to TOTLVLS.
+ */
+static void
+bcon_wake(buddy_concurrent_t *c, int lvl, int last)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->waiters, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	for (; lvl <= last; lvl++) {
+		if (__atomic_load_n(&c->wait[lvl].n, __ATOMIC_RELAXED) != 0) {
+			__atomic_fetch_add(&c->wait[lvl].seq, 1, __ATOMIC_SEQ_CST);
+			syscall(SYS_futex, &c->wait[lvl].seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+		}
+	}
+}
+
+/*
+ * free a block above the cut whose cell is in state want, returns its
+ * level or 0 if there was none
+ */
+static int
+bcon_topfree(buddy_concurrent_t *c, size_t off, int want)
+{
+	buddy_allocator_t *b = &c->b;
+	long cell;
+	int lvl = 1, m = 0;
+	pthread_mutex_lock(&c->top);
+	if ((cell = cfind(b, 1, &lvl, c->k - 1, off, want)) != 0) {
+		aset(b->bits, cell, CFREE);
+		m = cmerge(b->bits, cell, lvl, 1);
+	}
+	pthread_mutex_unlock(&c->top);
+	if (cell == 0) {
+		return 0;
+	}
+	bcon_wake(c, m, TOTLVLS);
+	__atomic_fetch_sub(&b->inuse, LVLSIZE(b, lvl), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&b->unused, LVLSIZE(b, lvl), __ATOMIC_RELAXED);
+	BPROBE(free, lvl, cell, off);
+	return lvl;
+}
+
+/*
+ * free the block at off, which lies under root and the lock of that
+ * subtree is held. its cell has to be in state want. merges stop at the
+ * root, merge is set when the root came free and the levels above have
+ * to follow.
+ */
+static int
+bcon_free1(buddy_concurrent_t *c, long root, size_t off, int want, bool *merge)
+{
+	buddy_allocator_t *b = &c->b;
+	size_t rel;
+	long cell;
+	int lvl = c->k, m;
+	if (astate(b->bits, root) == CFREE) {
+		/* nothing in use in the subtree, off can only start a block above it */
+		return bcon_topfree(c, off, want);
+	}
+	ccellat(b, off, c->k, &rel);
+	if ((cell = cfind(b, root, &lvl, TOTLVLS, rel, want)) == 0) {
+		return 0;
+	}
+	aset(b->bits, cell, CFREE);
+	if ((m = cmerge(b->bits, cell, lvl, c->k)) == c->k) {
+		*merge = true;
+	} else {
+		bcon_wake(c, m, TOTLVLS);
+	}
+	__atomic_fetch_sub(&b->inuse, LVLSIZE(b, lvl), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&b->unused, LVLSIZE(b, lvl), __ATOMIC_RELAXED);
+	BPROBE(free, lvl, cell, off);
+	return lvl;
+}
+
+/* the batch free path, the pending frees of subtree i whose lock is held */
+static void
+bcon_drain(buddy_concurrent_t *c, long i, bool *merge)
+{
+	size_t off, next;
+	if (__atomic_load_n(&c->sub[i].pending, __ATOMIC_RELAXED) == BUDDY_NOOFF) {
+		return;
+	}
+	off = __atomic_exchange_n(&c->sub[i].pending, BUDDY_NOOFF, __ATOMIC_ACQUIRE);
+	for (; off != BUDDY_NOOFF; off = next) {
+		next = *(size_t *)((char *)c->b.memstart + off);
+		bcon_free1(c, c->nsub + i, off, CHELD, merge);
+	}
+}
+
+/* the root of a subtree came free, merge it into the levels above */
+static void
+bcon_mergeup(buddy_concurrent_t *c, long root)
+{
+	int m = c->k;
+	pthread_mutex_lock(&c->top);
+	if (astate(c->b.bits, root) == CFREE) {
+		m = cmerge(c->b.bits, root, c->k, 1);
+	}
+	pthread_mutex_unlock(&c->top);
+	bcon_wake(c, m, TOTLVLS);
+}
+
+/*
+ * alloc on tlvl in subtree i, whose lock is held. a root that came free
+ * in the drain is not merged up, the alloc takes it again right away and
+ * only wakes the waiters for what is left of it.
+ */
+static long
+bcon_suballoc(buddy_concurrent_t *c, long i, int tlvl)
+{
+	unsigned char *bits = c->b.bits;
+	long root = c->nsub + i, a, cell = 0;
+	bool merge = false;
+	bcon_drain(c, i, &merge);
+	switch (astate(bits, root)) {
+	case CSPLIT:
+		return cwalk(bits, root, c->k, tlvl);
+	case CFULL:
+	case CHELD:
+		return 0;
+	}
+	/* a free root, the cells above it change with it. full and held have the low bit set */
+	pthread_mutex_lock(&c->top);
+	for (a = root >> 1; a != 0 && (astate(bits, a) & 1) == 0; a >>= 1)
+		;
+	if (a == 0) {
+		cell = cwalk(bits, root, c->k, tlvl);
+		for (a = root >> 1; a != 0 && astate(bits, a) == CFREE; a >>= 1) {
+			aset(bits, a, CSPLIT);
+		}
+	}
+	pthread_mutex_unlock(&c->top);
+	if (merge) {
+		bcon_wake(c, c->k, TOTLVLS);
+	}
+	return cell;
+}
+
+/* free the pending list of subtree i */
+static void
+bcon_flushsub(buddy_concurrent_t *c, long i)
+{
+	bool merge = false;
+	pthread_mutex_lock(&c->sub[i].m);
+	bcon_drain(c, i, &merge);
+	if (merge) {
+		bcon_mergeup(c, c->nsub + i);
+	}
+	pthread_mutex_unlock(&c->sub[i].m);
+}
+
+/* free the pending lists of all subtrees, false if they were all empty */
+static bool
+bcon_flushall(buddy_concurrent_t *c)
+{
+	bool any = false;
+	long i;
+	for (i = 0; i < c->nsub; i++) {
+		if (__atomic_load_n(&c->sub[i].pending, __ATOMIC_RELAXED) != BUDDY_NOOFF) {
+			bcon_flushsub(c, i);
+			any = true;
+		}
+	}
+	return any;
+}
+
+/* free off, whose cell is in state want, under the lock of its subtree */
+static int
+bcon_lockfree(buddy_concurrent_t *c, long root, size_t off, int want)
+{
+	long i = root - c->nsub;
+	bool merge = false;
+	int lvl;
+	pthread_mutex_lock(&c->sub[i].m);
+	bcon_drain(c, i, &merge);
+	lvl = bcon_free1(c, root, off, want, &merge);
+	if (merge) {
+		bcon_mergeup(c, root);
+	}
+	pthread_mutex_unlock(&c->sub[i].m);
+	return lvl;
+}
+
+/* the subtree the thread last allocated from in c, -1 before its first alloc */
+static inline long
+bcon_home(buddy_concurrent_t *c)
+{
+	return (long)(intptr_t)pthread_getspecific(c->home) - 1;
+}
+
+/*
+ * a cell on tlvl from the subtrees, or above the cut under the top lock.
+ * a block above the cut may be waiting on frees still pending in the
+ * subtrees, those are freed before it gives up.
+ */
+static long
+bcon_treealloc(buddy_concurrent_t *c, int tlvl)
+{
+	long cell = 0, i = 0, n, home, h;
+	int pass;
+	if (tlvl < c->k) {
+		for (pass = 0; pass < 2 && cell == 0; pass++) {
+			if (pass == 1 && !bcon_flushall(c)) {
+				break;
+			}
+			pthread_mutex_lock(&c->top);
+			cell = cwalk(c->b.bits, 1, 1, tlvl);
+			pthread_mutex_unlock(&c->top);
+		}
+		return cell;
+	}
+	if ((home = h = bcon_home(c)) < 0) {
+		home = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED) % c->nsub;
+	}
+	/* one round that skips the subtrees other threads are in, one that waits */
+	for (pass = 0; pass < 2 && cell == 0; pass++) {
+		for (n = 0; n < c->nsub && cell == 0; n++) {
+			i = (home + n) % c->nsub;
+			if (pass == 0 && pthread_mutex_trylock(&c->sub[i].m) != 0) {
+				continue;
+			}
+			if (pass == 1) {
+				pthread_mutex_lock(&c->sub[i].m);
+			}
+			cell = bcon_suballoc(c, i, tlvl);
+			pthread_mutex_unlock(&c->sub[i].m);
+		}
+	}
+	if (cell != 0) {
+		home = i;
+	}
+	if (home != h) {
+		pthread_setspecific(c->home, (void *)(intptr_t)(home + 1));
+	}
+	return cell;
+}
+
+#ifdef BUDRSEQ
+/*
+ * the critical sections. the descriptor goes in __rseq_cs and the abort
+ * handler, behind the signature the kernel checks, in __rseq_failure. the
+ * cpu the list belongs to is compared with the one the thread runs on
+ * after the section is armed, and the last instruction is the commit.
+ */
+#define BRSEQSTART \
+	".pushsection __rseq_cs, \"aw\"\n\t" \
+	".balign 32\n\t" \
+	"3:\n\t" \
+	".long 0x0, 0x0\n\t" \
+	".quad 1f, (2f - 1f), 4f\n\t" \
+	".popsection\n\t" \
+	"leaq 3b(%%rip), %%rax\n\t" \
+	"movq %%rax, %[rseqcs]\n\t" \
+	"1:\n\t" \
+	"cmpl %[cpu], %[cpuid]\n\t" \
+	"jnz 4f\n\t"
+#define BRSEQEND \
+	"2:\n\t" \
+	".pushsection __rseq_failure, \"ax\"\n\t" \
+	".long 0x53053053\n\t" \
+	"4:\n\t" \
+	"jmp %l[abort]\n\t" \
+	".popsection\n\t"
+
+static inline struct rseq *
+bcon_rseq(void)
+{
+	return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/*
+ * pop the list of cpu into out, NULL if it is empty or another thread
+ * takes it. -1 if restarted.
+ */
+static inline int
+rseqpop(struct rseq *rs, int cpu, struct bconcpu *pc, int lvl, void **out)
+{
+	__asm__ goto(BRSEQSTART
+	    "cmpl $0, %[stop]\n\t"
+	    "jnz %l[empty]\n\t"
+	    "movq %[head], %%rax\n\t"
+	    "testq %%rax, %%rax\n\t"
+	    "jz %l[empty]\n\t"
+	    "movq (%%rax), %%rcx\n\t"
+	    "movq %%rax, %[out]\n\t"
+	    "movq %%rcx, %[head]\n\t"
+	    BRSEQEND
+	    :
+	    : [cpu] "r" (cpu), [cpuid] "m" (rs->cpu_id), [rseqcs] "m" (rs->rseq_cs),
+	      [stop] "m" (pc->stop), [head] "m" (pc->head[lvl]), [out] "m" (*out)
+	    : "memory", "cc", "rax", "rcx"
+	    : abort, empty);
+	return 0;
+abort:
+	return -1;
+empty:
+	*out = NULL;
+	return 0;
+}
+
+/*
+ * push blk on the list of cpu. a block holds the next one and the length
+ * of the list from itself down. 1 if the list is full or another thread
+ * takes it, -1 if restarted.
+ */
+static inline int
+rseqpush(struct rseq *rs, int cpu, struct bconcpu *pc, int lvl, void *blk)
+{
+	__asm__ goto(BRSEQSTART
+	    "cmpl $0, %[stop]\n\t"
+	    "jnz %l[full]\n\t"
+	    "movq %[head], %%rax\n\t"
+	    "movq $1, %%rcx\n\t"
+	    "testq %%rax, %%rax\n\t"
+	    "jz 5f\n\t"
+	    "movq 8(%%rax), %%rcx\n\t"
+	    "incq %%rcx\n\t"
+	    "cmpq %[max], %%rcx\n\t"
+	    "ja %l[full]\n\t"
+	    "5:\n\t"
+	    "movq %%rax, (%[blk])\n\t"
+	    "movq %%rcx, 8(%[blk])\n\t"
+	    "movq %[blk], %[head]\n\t"
+	    BRSEQEND
+	    :
+	    : [cpu] "r" (cpu), [cpuid] "m" (rs->cpu_id), [rseqcs] "m" (rs->rseq_cs),
+	      [stop] "m" (pc->stop), [head] "m" (pc->head[lvl]), [blk] "r" (blk),
+	      [max] "r" ((size_t)BCPUCACHEN)
+	    : "memory", "cc", "rax", "rcx"
+	    : abort, full);
+	return 0;
+abort:
+	return -1;
+full:
+	return 1;
+}
+
+static inline bool
+bcon_cached(buddy_concurrent_t *c, int lvl)
+{
+	return c->cpus != NULL && LVLSIZE(&c->b, lvl) <= BCPUCACHEMAX &&
+	    LVLSIZE(&c->b, lvl) >= 2 * sizeof(void *);
+}
+
+/* a block of lvl from the cache of this cpu, marked full again */
+static void *
+bcon_cpupop(buddy_concurrent_t *c, int lvl)
+{
+	struct rseq *rs = bcon_rseq();
+	size_t rel;
+	void *blk;
+	int cpu;
+	/* the cpu ids never match in a thread without rseq */
+	if ((int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED) < 0) {
+		return NULL;
+	}
+	do {
+		if ((cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED)) >= c->ncpu) {
+			return NULL;
+		}
+	} while (rseqpop(rs, cpu, &c->cpus[cpu], lvl, &blk) != 0);
+	if (blk != NULL) {
+		aset(c->b.bits, ccellat(&c->b, (char *)blk - (char *)c->b.memstart, lvl, &rel), CFULL);
+	}
+	return blk;
+}
+
+/* the cpu whose cache blk, whose cell is held, went in, -1 if none */
+static int
+bcon_cpupush(buddy_concurrent_t *c, int lvl, void *blk)
+{
+	struct rseq *rs = bcon_rseq();
+	int cpu, r;
+	if ((int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED) < 0) {
+		return -1;
+	}
+	do {
+		if ((cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED)) >= c->ncpu) {
+			return -1;
+		}
+	} while ((r = rseqpush(rs, cpu, &c->cpus[cpu], lvl, blk)) == -1);
+	return r == 0 ? cpu : -1;
+}
+
+/*
+ * give the cache of the cpu the thread runs on back to the tree. the
+ * blocks are popped as full ones.
+ */
+static size_t
+bcon_cpuflush(buddy_concurrent_t *c)
+{
+	size_t n = 0, off, rel;
+	void *blk;
+	int lvl;
+	for (lvl = 1; lvl <= TOTLVLS; lvl++) {
+		if (!bcon_cached(c, lvl)) {
+			continue;
+		}
+		while ((blk = bcon_cpupop(c, lvl)) != NULL) {
+			off = (char *)blk - (char *)c->b.memstart;
+			bcon_lockfree(c, ccellat(&c->b, off, c->k, &rel), off, CFULL);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * give the cache of cpu, or of every cpu if it is -1, back to the tree
+ * from any thread. the stop flags keep new sequences off the lists and
+ * the membarrier restarts the ones in flight, after that the lists only
+ * change here. the blocks are freed as held ones.
+ */
+static void
+bcon_cpusteal(buddy_concurrent_t *c, int cpu)
+{
+	int first = cpu < 0 ? 0 : cpu, last = cpu < 0 ? c->ncpu - 1 : cpu, i, lvl;
+	size_t off, rel;
+	void *blk, *next;
+	pthread_mutex_lock(&c->steal);
+	for (i = first; i <= last; i++) {
+		__atomic_store_n(&c->cpus[i].stop, 1, __ATOMIC_SEQ_CST);
+	}
+	/* a kernel that can't aim at one cpu restarts the sequences on all of them */
+	if (cpu < 0 || syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ,
+	    MEMBARRIER_CMD_FLAG_CPU, cpu) != 0) {
+		syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+	}
+	for (i = first; i <= last; i++) {
+		for (lvl = 1; lvl <= TOTLVLS; lvl++) {
+			blk = c->cpus[i].head[lvl];
+			c->cpus[i].head[lvl] = NULL;
+			for (; blk != NULL; blk = next) {
+				next = *(void **)blk;
+				off = (char *)blk - (char *)c->b.memstart;
+				bcon_lockfree(c, ccellat(&c->b, off, c->k, &rel), off, CHELD);
+			}
+		}
+		__atomic_store_n(&c->cpus[i].stop, 0, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&c->steal);
+}
+#endif
+
+/* a concurrent allocator with its tree cut at level k, 1 <= k <= TOTLVLS */
+BUDAPI buddy_concurrent_t *
+buddy_concurrent_create(void *raw_mem, size_t memsz, int k)
+{
+	buddy_concurrent_t *c;
+	long i;
+	if (k < 1 || k > TOTLVLS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((c = (buddy_concurrent_t *)malloc(sizeof(*c))) == NULL) {
+		return NULL;
+	}
+	c->nsub = 1L << (k-1);
+	if ((c->sub = (struct bconsub *)aligned_alloc(BCONLINE, c->nsub * sizeof(*c->sub))) == NULL) {
+		free(c);
+		return NULL;
+	}
+	if ((errno = pthread_key_create(&c->home, NULL)) != 0) {
+		free(c->sub);
+		free(c);
+		return NULL;
+	}
+	buddy_allocator_init(&c->b, raw_mem, memsz);
+	c->k = k;
+	c->next = 0;
+	c->remote = raw_mem != NULL && LVLSIZE(&c->b, TOTLVLS) >= sizeof(size_t);
+	pthread_mutex_init(&c->top, NULL);
+	for (i = 0; i < c->nsub; i++) {
+		pthread_mutex_init(&c->sub[i].m, NULL);
+		c->sub[i].pending = BUDDY_NOOFF;
+	}
+	c->ncpu = 0;
+	c->cpus = NULL;
+	c->waiters = 0;
+	memset(c->wait, 0, sizeof(c->wait));
+#ifdef BUDRSEQ
+	pthread_mutex_init(&c->steal, NULL);
+	/*
+	 * without an arena, a registered rseq area or the membarrier that lets
+	 * other threads empty a cache there is no cache
+	 */
+	if (raw_mem != NULL && __rseq_size != 0 && (int)bcon_rseq()->cpu_id >= 0 &&
+	    syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0) {
+		c->ncpu = sysconf(_SC_NPROCESSORS_CONF);
+		c->cpus = (struct bconcpu *)aligned_alloc(BCONLINE, c->ncpu * sizeof(*c->cpus));
+		if (c->cpus != NULL) {
+			memset(c->cpus, 0, c->ncpu * sizeof(*c->cpus));
+		}
+	}
+#endif
+	return c;
+}
+
+BUDAPI void
+buddy_concurrent_destroy(buddy_concurrent_t *c)
+{
+	long i;
+	for (i = 0; i < c->nsub; i++) {
+		pthread_mutex_destroy(&c->sub[i].m);
+	}
+	pthread_mutex_destroy(&c->top);
+#ifdef BUDRSEQ
+	pthread_mutex_destroy(&c->steal);
+#endif
+	pthread_key_delete(c->home);
+	free(c->cpus);
+	free(c->sub);
+	free(c);
+}
+
+/*
+ * the tree and counters underneath, for the introspection calls. they
+ * only see a consistent tree while no other thread is in c, and pending
+ * or cached frees only show after buddy_concurrent_drain().
+ */
+BUDAPI buddy_allocator_t *
+buddy_concurrent_allocator(buddy_concurrent_t *c)
+{
+	return &c->b;
+}
+
+BUDAPI size_t
+buddy_concurrent_alloc(buddy_concurrent_t *c, size_t sz)
+{
+	buddy_allocator_t *b = &c->b;
+	int tlvl = targetlevel(b->memsz, b->shift, sz);
+	long cell = 0;
+	size_t off;
+	BSTATSTART(start);
+#ifdef BUDRSEQ
+	void *blk;
+	if (tlvl != 0 && bcon_cached(c, tlvl) && (blk = bcon_cpupop(c, tlvl)) != NULL) {
+		__atomic_fetch_add(&b->requested, sz, __ATOMIC_RELAXED);
+		BSTATEND(BSTAT_ALLOC_OK, start);
+		return (char *)blk - (char *)b->memstart;
+	}
+#endif
+	if (tlvl != 0) {
+		cell = bcon_treealloc(c, tlvl);
+	}
+#ifdef BUDRSEQ
+	if (cell == 0 && tlvl != 0 && c->cpus != NULL && bcon_cpuflush(c) != 0) {
+		cell = bcon_treealloc(c, tlvl);
+	}
+#endif
+	if (cell == 0) {
+		BSTATEND(BSTAT_ALLOC_FAIL, start);
+		return BUDDY_NOOFF;
+	}
+	__atomic_fetch_add(&b->requested, sz, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&b->inuse, LVLSIZE(b, tlvl), __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&b->unused, LVLSIZE(b, tlvl), __ATOMIC_RELAXED);
+	BSTATEND(BSTAT_ALLOC_OK, start);
+	off = walkoffset(b, tlvl, cell);
+	BPROBE(alloc, tlvl, cell, off);
+	return off;
+}
+
+/* returns 0 if off was the start of an allocated block, -1 otherwise */
+BUDAPI int
+buddy_concurrent_free(buddy_concurrent_t *c, size_t off)
+{
+	buddy_allocator_t *b = &c->b;
+	size_t rel, head;
+	long root, i, cell;
+	int lvl;
+	if (off >= b->memsz) {
+		return -1;
+	}
+	BSTATSTART(start);
+#ifdef BUDRSEQ
+	lvl = 1;
+	if (c->cpus != NULL && __atomic_load_n(&c->waiters, __ATOMIC_RELAXED) == 0 &&
+	    (cell = cfind(b, 1, &lvl, TOTLVLS, off, CFULL)) != 0 &&
+	    bcon_cached(c, lvl) && acas(b->bits, cell, CFULL, CHELD)) {
+		if ((i = bcon_cpupush(c, lvl, (char *)b->memstart + off)) >= 0) {
+			/* a waiter came in between and may have drained that cache already */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&c->waiters, __ATOMIC_RELAXED) != 0) {
+				bcon_cpusteal(c, i);
+			}
+			BSTATEND(BSTAT_FREE, start);
+			return 0;
+		}
+		/* no room in the cache, free it like any other block */
+		aset(b->bits, cell, CFULL);
+	}
+#endif
+	root = ccellat(b, off, c->k, &rel);
+	i = root - c->nsub;
+	if (c->remote && i != bcon_home(c)) {
+		/*
+		 * the link goes into the block, so it has to start a block in use,
+		 * which the path down to it stays valid for without a lock. a
+		 * power of two arena can refuse a misaligned off before the walk.
+		 */
+		lvl = 1;
+		if ((b->shift != 0 && (off & (LVLSIZE(b, TOTLVLS) - 1)) != 0) ||
+		    off + sizeof(size_t) > b->memsz ||
+		    (cell = cfind(b, 1, &lvl, TOTLVLS, off, CFULL)) == 0 ||
+		    !acas(b->bits, cell, CFULL, CHELD)) {
+			BSTATEND(BSTAT_FREE, start);
+			return -1;
+		}
+		head = __atomic_load_n(&c->sub[i].pending, __ATOMIC_RELAXED);
+		do {
+			*(size_t *)((char *)b->memstart + off) = head;
+		} while (!__atomic_compare_exchange_n(&c->sub[i].pending, &head, off, true,
+		    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+		if (__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST) != 0) {
+			bcon_flushsub(c, i);
+		}
+		BSTATEND(BSTAT_FREE, start);
+		return 0;
+	}
+	lvl = bcon_lockfree(c, root, off, CFULL);
+	BSTATEND(BSTAT_FREE, start);
+	return lvl != 0 ? 0 : -1;
+}
+
+/*
+ * like buddy_concurrent_alloc() but if there is no room it waits for
+ * frees to make some, for at most timeout (forever if NULL). fails with
+ * ETIMEDOUT when the time is up and with ENOMEM right away for a request
+ * that is bigger than the whole arena.
+ */
+BUDAPI size_t
+buddy_concurrent_alloc_wait(buddy_concurrent_t *c, size_t sz, const struct timespec *timeout)
+{
+	struct timespec dl;
+	uint32_t seq;
+	size_t off;
+	int tlvl = targetlevel(c->b.memsz, c->b.shift, sz);
+	if (tlvl == 0) {
+		errno = ENOMEM;
+		return BUDDY_NOOFF;
+	}
+	if ((off = buddy_concurrent_alloc(c, sz)) != BUDDY_NOOFF) {
+		return off;
+	}
+	if (timeout != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &dl);
+		dl.tv_sec += timeout->tv_sec;
+		if ((dl.tv_nsec += timeout->tv_nsec) >= 1000000000L) {
+			dl.tv_sec++;
+			dl.tv_nsec -= 1000000000L;
+		}
+	}
+	__atomic_fetch_add(&c->waiters, 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&c->wait[tlvl].n, 1, __ATOMIC_SEQ_CST);
+	/* frees from here on don't keep blocks back, put back what was kept */
+	buddy_concurrent_drain(c);
+	for (;;) {
+		/* a free after this load changes seq and the wait returns at once */
+		seq = __atomic_load_n(&c->wait[tlvl].seq, __ATOMIC_SEQ_CST);
+		if ((off = buddy_concurrent_alloc(c, sz)) != BUDDY_NOOFF) {
+			break;
+		}
+		if (syscall(SYS_futex, &c->wait[tlvl].seq, FUTEX_WAIT_BITSET_PRIVATE, seq,
+		    timeout != NULL ? &dl : NULL, NULL, FUTEX_BITSET_MATCH_ANY) == -1 &&
+		    errno == ETIMEDOUT) {
+			break;
+		}
+	}
+	__atomic_fetch_sub(&c->wait[tlvl].n, 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_sub(&c->waiters, 1, __ATOMIC_SEQ_CST);
+	if (off == BUDDY_NOOFF) {
+		errno = ETIMEDOUT;
+		return BUDDY_NOOFF;
+	}
+	bcon_wake(c, tlvl, tlvl);
+	return off;
+}
+
+/*
+ * free everything on the pending lists and in the cpu caches, e.g. before
+ * looking at the tree
+ */
+BUDAPI void
+buddy_concurrent_drain(buddy_concurrent_t *c)
+{
+#ifdef BUDRSEQ
+	if (c->cpus != NULL) {
+		bcon_cpusteal(c, -1);
+	}
+#endif
+	bcon_flushall(c);
+}
+
+BUDAPI void
+buddy_allocator_print_levels(buddy_allocator_t *b)
+{
+	struct buddy_level lv[TOTLVLS];
+	int i;
+	buddy_allocator_levels(b, lv);
+	for (i = 0; i < TOTLVLS; i++) {
+		printf("level %d\tblocksz:%zd\tfull:%zd\tsplit:%zd\tfree:%zd\n", i+1,
+			lv[i].blocksz, lv[i].full, lv[i].split, lv[i].free);
 	}
-	b = buddy_allocator_create(arena, in);
-	repl(b);
-	buddy_allocator_destroy(b);
-	free(arena);
-	return EXIT_SUCCESS;
 }
@@ -0,0 +1,258 @@
+/*
+ * public interface of budalloc, the space efficient tree based buddy
+ * allocator. see budalloc.c for how the bittree works.
+ *
+ * the layout of buddy_allocator_t depends on TOTLVLS, everything that
+ * includes this header has to be built with the same -DTOTLVLS as the
+ * allocator itself.
+ */
+#ifndef BUDALLOC_H
+#define BUDALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * the depth of the tree, override with -DTOTLVLS=n. the bitfield holds
+ * 2 bits for each of the 2^TOTLVLS-1 cells.
+ */
+#ifndef TOTLVLS
+#define TOTLVLS 4
+#endif
+#if TOTLVLS < 1 || TOTLVLS > 63
+#error "TOTLVLS has to be between 1 and 63, cells are numbered in a long"
+#endif
+#define BITFIELDBYTES    ((((1L << TOTLVLS) - 1) * 2) / 8 + 1)
+
+/* returned by the offset calls when there is no block */
+#define BUDDY_NOOFF ((size_t)-1)
+
+/*
+ * how alloc and free walk the tree, see buddy_allocator_engine(). the
+ * first two place first fit by offset, the freemap engine takes the
+ * lowest free block of the right size before it splits a bigger one.
+ */
+enum {
+	BUDDY_ENGINE_ITERATIVE,
+	BUDDY_ENGINE_RECURSIVE,
+	BUDDY_ENGINE_FREEMAP
+};
+
+#define BSTATBUCKETS 64
+enum {
+	BSTAT_ALLOC_OK,
+	BSTAT_ALLOC_FAIL,
+	BSTAT_FREE,
+	BSTAT_NHIST
+};
+
+/*
+ * the stats page published with buddy_allocator_shm_publish(). the
+ * allocator is the only writer and bumps seq to odd before and back to
+ * even after touching the rest. readers copy everything out and retry if
+ * seq was odd or changed under them, so they never hold up the allocator.
+ * lvlfull has a slot per level up to BSHMMAXLVLS, the first levels are valid.
+ */
+#define BSHMMAGIC   0x42554453484d3031ULL /* BUDSHM01 */
+#define BSHMMAXLVLS 64
+struct buddy_shm_page {
+	uint64_t magic;
+	uint64_t seq;
+	uint32_t levels;
+	uint32_t pad;
+	uint64_t memsz;
+	uint64_t inuse, unused, requested;
+	uint64_t lvlfull[BSHMMAXLVLS];
+};
+
+struct bprof;
+struct bfreemap;
+
+/*
+ * shift is log2(memsz) when memsz is a power of two with at least a byte
+ * per block on the last level, which lets a request find its level with a
+ * single clz. it is 0 for any other size.
+ */
+typedef struct buddy_allocator {
+	void *memstart;
+	size_t memsz;
+	int shift;
+	int engine;
+	size_t inuse, unused, requested;
+	unsigned char bits[BITFIELDBYTES];
+	struct buddy_shm_page *shm;
+	uint32_t epoch, *epochs;
+	struct bprof *prof;
+	struct bfreemap *freemap;
+} buddy_allocator_t;
+
+/*
+ * the same tree in one bit per cell instead of two, half the metadata of
+ * a buddy_allocator_t. it is offset only and has none of the hooks, see
+ * buddy_compact_alloc() in budalloc.c for the encoding.
+ */
+#define CBITFIELDBYTES   ((1L << TOTLVLS) / 8 + 1)
+typedef struct buddy_compact {
+	size_t memsz;
+	int shift;
+	size_t inuse, unused, requested;
+	unsigned char bits[CBITFIELDBYTES];
+} buddy_compact_t;
+
+/*
+ * snapshot of the allocator counters. hist[] holds the latency histograms
+ * summed over all threads where bucket i counts calls that took
+ * [2^i, 2^(i+1)) cycles. it is only filled in when built with BUDSTATS,
+ * and it covers every allocator in the process, not only the one asked.
+ */
+struct buddy_stats {
+	size_t memsz;
+	size_t inuse, unused, requested;
+	uint64_t hist[BSTAT_NHIST][BSTATBUCKETS];
+};
+
+/* occupancy of one level of the tree, see buddy_allocator_levels() */
+struct buddy_level {
+	size_t blocksz;
+	size_t full, split, free;
+};
+
+/*
+ * a snapshot is this header followed by bitbytes bytes of the bittree, all
+ * in host byte order. it is what the sigdump writes next to its report.
+ */
+#define BUDSNAPMAGIC "BUDSNAP1"
+struct buddy_snapshot_hdr {
+	char magic[8];
+	uint32_t levels;
+	uint32_t bitbytes;
+	uint64_t memsz, inuse, unused, requested;
+};
+
+typedef int (*buddy_block_cb)(void *ctx, size_t offset, size_t size);
+typedef void (*buddy_epoch_cb)(void *ctx, size_t offset, size_t size, uint32_t epoch);
+
+/*
+ * BUDALLOC_HEADER_ONLY (see budalloc_single.h) compiles the whole
+ * allocator into the including file with every call static inline, so
+ * that the hot paths can be inlined and folded into their callers.
+ */
+#ifdef BUDALLOC_HEADER_ONLY
+#define BUDAPI static inline
+#else
+#define BUDAPI
+#endif
+
+/*
+ * the library defines buddy_abi_totlvls_<TOTLVLS> and every file that
+ * includes this header references the one of its own TOTLVLS, so linking
+ * against a library built for another depth fails with an undefined
+ * symbol instead of corrupting the allocator at run time.
+ */
+#define BUDDY_ABICAT(a, n) a##n
+#define BUDDY_ABISYM(n)    BUDDY_ABICAT(buddy_abi_totlvls_, n)
+#ifndef BUDALLOC_HEADER_ONLY
+extern const int BUDDY_ABISYM(TOTLVLS);
+static const int *const buddy_abi_check __attribute__((used)) = &BUDDY_ABISYM(TOTLVLS);
+#endif
+
+typedef struct buddy_file buddy_file_t;
+typedef struct buddy_shared buddy_shared_t;
+typedef struct buddy_concurrent buddy_concurrent_t;
+
+/* setup and teardown */
+BUDAPI void               buddy_allocator_init(buddy_allocator_t *, void *, size_t);
+BUDAPI buddy_allocator_t *buddy_allocator_create(void *, size_t);
+BUDAPI void               buddy_allocator_destroy(buddy_allocator_t *);
+BUDAPI int                buddy_allocator_engine(buddy_allocator_t *, int);
+
+/* pointer api */
+BUDAPI void  *buddy_allocator_alloc(buddy_allocator_t *, size_t);
+BUDAPI void   buddy_allocator_free(buddy_allocator_t *, void *);
+BUDAPI void   buddy_allocator_free_sized(buddy_allocator_t *, void *, size_t);
+
+/* offset api, works without an arena */
+BUDAPI size_t buddy_offset_alloc(buddy_allocator_t *, size_t);
+BUDAPI int    buddy_offset_free(buddy_allocator_t *, size_t);
+BUDAPI int    buddy_offset_free_sized(buddy_allocator_t *, size_t, size_t);
+BUDAPI size_t buddy_offset_size(buddy_allocator_t *, size_t);
+
+/* introspection */
+BUDAPI void   buddy_allocator_stats(buddy_allocator_t *, struct buddy_stats *);
+BUDAPI void   buddy_allocator_levels(buddy_allocator_t *, struct buddy_level *);
+BUDAPI int    buddy_allocator_foreach(buddy_allocator_t *, buddy_block_cb, void *);
+BUDAPI int    buddy_allocator_snapshot(buddy_allocator_t *, int);
+BUDAPI void   buddy_allocator_print(buddy_allocator_t *);
+BUDAPI void   buddy_allocator_print_stats(buddy_allocator_t *);
+BUDAPI void   buddy_allocator_print_levels(buddy_allocator_t *);
+BUDAPI int    buddy_allocator_sigdump(buddy_allocator_t *, int, const char *, bool);
+
+/* generation tags */
+BUDAPI int      buddy_allocator_epoch_enable(buddy_allocator_t *);
+BUDAPI uint32_t buddy_allocator_epoch_advance(buddy_allocator_t *);
+BUDAPI void     buddy_allocator_epoch_older(buddy_allocator_t *, uint32_t, buddy_epoch_cb, void *);
+
+/* shm stats page */
+BUDAPI int    buddy_allocator_shm_publish(buddy_allocator_t *, const char *);
+BUDAPI void   buddy_allocator_shm_unpublish(buddy_allocator_t *, const char *);
+BUDAPI const struct buddy_shm_page *buddy_shm_open(const char *);
+BUDAPI void   buddy_shm_close(const struct buddy_shm_page *);
+BUDAPI int    buddy_shm_read(const struct buddy_shm_page *, struct buddy_shm_page *);
+
+/*
+ * sampling profiler. in builds without BUDPROF start fails with ENOSYS
+ * and stop and dump do nothing.
+ */
+BUDAPI int    buddy_allocator_prof_start(buddy_allocator_t *, unsigned long);
+BUDAPI void   buddy_allocator_prof_stop(buddy_allocator_t *);
+BUDAPI void   buddy_allocator_prof_dump(buddy_allocator_t *, FILE *);
+
+/* file extent backend */
+BUDAPI buddy_file_t *buddy_file_open(const char *, size_t, size_t);
+BUDAPI int     buddy_file_close(buddy_file_t *);
+BUDAPI int     buddy_file_sync(buddy_file_t *);
+BUDAPI size_t  buddy_file_alloc(buddy_file_t *, size_t);
+BUDAPI int     buddy_file_free(buddy_file_t *, size_t);
+BUDAPI ssize_t buddy_file_pread(buddy_file_t *, void *, size_t, size_t);
+BUDAPI ssize_t buddy_file_pwrite(buddy_file_t *, const void *, size_t, size_t);
+
+/* process shared allocator */
+BUDAPI buddy_shared_t *buddy_shared_create(const char *, size_t);
+BUDAPI buddy_shared_t *buddy_shared_attach(const char *);
+BUDAPI buddy_shared_t *buddy_shared_attach_fd(int);
+BUDAPI void    buddy_shared_detach(buddy_shared_t *);
+BUDAPI int     buddy_shared_fd(buddy_shared_t *);
+BUDAPI size_t  buddy_shared_alloc(buddy_shared_t *, size_t);
+BUDAPI int     buddy_shared_free(buddy_shared_t *, size_t);
+BUDAPI void   *buddy_shared_ptr(buddy_shared_t *, size_t);
+BUDAPI size_t  buddy_shared_off(buddy_shared_t *, const void *);
+
+/* compact tree */
+BUDAPI void   buddy_compact_init(buddy_compact_t *, size_t);
+BUDAPI size_t buddy_compact_alloc(buddy_compact_t *, size_t);
+BUDAPI int    buddy_compact_free(buddy_compact_t *, size_t);
+BUDAPI int    buddy_compact_free_sized(buddy_compact_t *, size_t, size_t);
+BUDAPI void   buddy_compact_expand(buddy_compact_t *, buddy_allocator_t *);
+
+/* concurrent allocator, a lock per subtree */
+BUDAPI buddy_concurrent_t *buddy_concurrent_create(void *, size_t, int);
+BUDAPI void    buddy_concurrent_destroy(buddy_concurrent_t *);
+BUDAPI buddy_allocator_t *buddy_concurrent_allocator(buddy_concurrent_t *);
+BUDAPI size_t  buddy_concurrent_alloc(buddy_concurrent_t *, size_t);
+BUDAPI size_t  buddy_concurrent_alloc_wait(buddy_concurrent_t *, size_t, const struct timespec *);
+BUDAPI int     buddy_concurrent_free(buddy_concurrent_t *, size_t);
+BUDAPI void    buddy_concurrent_drain(buddy_concurrent_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUDALLOC_H */
@@ -0,0 +1,17 @@
+/*
+ * single header build of budalloc. including this instead of budalloc.h
+ * compiles the allocator into the including file with every function
+ * static inline, no library to link. the compiler sees the walks at the
+ * call site and can inline them and fold TOTLVLS and the level tables
+ * into the caller. each file that includes it gets its own private copy,
+ * so an allocator must only be used from the file that created it. it
+ * defines _GNU_SOURCE, so it has to come before any system header. it
+ * compiles as C and as C++.
+ */
+#ifndef BUDALLOC_SINGLE_H
+#define BUDALLOC_SINGLE_H
+
+#define BUDALLOC_HEADER_ONLY
+#include "budalloc.c"
+
+#endif /* BUDALLOC_SINGLE_H */
@@ -0,0 +1,667 @@
+/*
+ * budallocrepl is the cli of budalloc. it runs fake allocations and frees
+ * interactively or from a command file, watches a published stats page
+ * and analyzes snapshots. the allocator itself is in budalloc.c.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "budalloc.h"
+#include "budbits.h"
+
+static int
+printblock(void *ctx, size_t offset, size_t size)
+{
+	buddy_allocator_t *b = ctx;
+	printf("@%p\toffset:%zd\tsize:%zd\n", (char *)b->memstart + offset, offset, size);
+	return 0;
+}
+
+void
+repl(buddy_allocator_t *b)
+{
+	char cmd;
+	long val;
+	void *tofree;
+	long cells;
+	char path[1024];
+	int fd;
+	TOTCELLSFORLVL(TOTLVLS,cells);
+	printf("compiled for %d levels which provides %ld allocation cells\n", TOTLVLS, cells);
+	for (;;) {
+		printf(">");
+		scanf(" %c", &cmd);
+		switch(cmd) {
+		case 'Q':
+			return;
+		case 'A':
+			printf("how many?\n>");
+			scanf(" %zd", &val);
+			printf("Alloc @ %p\n", buddy_allocator_alloc(b, val));
+			break;
+		case 'F':
+			printf("which addr?\n>");
+			scanf(" %p", &tofree);
+			buddy_allocator_free(b, tofree);
+			break;
+		case 'P':
+			buddy_allocator_print(b);
+			break;
+		case 'S':
+			buddy_allocator_print_stats(b);
+			break;
+		case 'H':
+			buddy_allocator_print_levels(b);
+			break;
+		case 'L':
+			buddy_allocator_foreach(b, printblock, b);
+			break;
+		case 'D':
+			printf("which file?\n>");
+			scanf(" %1023s", path);
+			if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1 ||
+			    buddy_allocator_snapshot(b, fd) == -1) {
+				warn("%s", path);
+			}
+			if (fd != -1) {
+				close(fd);
+			}
+			break;
+#ifdef BUDPROF
+		case 'R':
+			buddy_allocator_prof_dump(b, stdout);
+			break;
+#endif
+		default:
+			printf("Q to quit, A to allocate, F to free, P to print, S for stats, H for the level histogram,\n"
+			       "L to list blocks, D to dump a snapshot\n"); 
+			break;
+		}
+	}
+	
+}
+
+/*
+ * offline analysis of a snapshot written by buddy_allocator_snapshot().
+ * the snapshot carries its own geometry so it doesn't have to match what
+ * this binary was compiled for. the tree is walked in address order, top
+ * levels by us and every reachable subtree rooted at level split by a
+ * pool of threads, and the per subtree results are stitched back together
+ * in order so that free runs crossing subtree boundaries come out whole.
+ */
+#define ANMAXLVLS 40
+
+struct ansnap {
+	struct buddy_snapshot_hdr h;
+	unsigned char *bits;
+};
+
+struct anrun {
+	uint64_t off, len;
+};
+
+struct anres {
+	uint64_t full[ANMAXLVLS], split[ANMAXLVLS], free[ANMAXLVLS];
+	uint64_t usedbytes, freebytes, largest;
+	struct anrun *runs;
+	size_t nruns, cap;
+};
+
+struct anseg {
+	long cell;
+	int lvl;
+	uint64_t off;
+	struct anres res;
+};
+
+struct anpool {
+	const struct ansnap *s;
+	struct anseg *segs;
+	size_t nsegs, next;
+	int split;
+};
+
+static void
+anaddrun(struct anres *r, uint64_t off, uint64_t len)
+{
+	struct anrun *n;
+	if (r->nruns > 0 && r->runs[r->nruns-1].off + r->runs[r->nruns-1].len == off) {
+		r->runs[r->nruns-1].len += len;
+		return;
+	}
+	if (r->nruns == r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 64;
+		if ((n = realloc(r->runs, r->cap * sizeof(*n))) == NULL) {
+			err(EXIT_FAILURE, "analyze");
+		}
+		r->runs = n;
+	}
+	r->runs[r->nruns].off = off;
+	r->runs[r->nruns].len = len;
+	r->nruns++;
+}
+
+static void
+anwalk(const struct ansnap *s, struct anres *r, long cell, int lvl, uint64_t off)
+{
+	uint64_t sz = s->h.memsz / (1ULL << (lvl-1));
+	if (ISSPLIT(s->bits, cell)) {
+		r->split[lvl-1]++;
+		if ((uint32_t)lvl < s->h.levels) {
+			anwalk(s, r, LEFTCHILD(cell), lvl+1, off);
+			anwalk(s, r, RIGHTCHILD(cell), lvl+1, off + s->h.memsz / (1ULL << lvl));
+		}
+	} else if (ISFULL(s->bits, cell)) {
+		r->full[lvl-1]++;
+		r->usedbytes += sz;
+	} else {
+		r->free[lvl-1]++;
+		r->freebytes += sz;
+		if (sz > r->largest) {
+			r->largest = sz;
+		}
+		anaddrun(r, off, sz);
+	}
+}
+
+/* 
+ * cut the tree at level split. split cells above it only add to the
+ * counters in top, everything else becomes a segment for the pool.
+ */
+static void
+anplan(struct anpool *pl, struct anres *top, long cell, int lvl, uint64_t off)
+{
+	struct anseg *sg;
+	if (lvl < pl->split && ISSPLIT(pl->s->bits, cell)) {
+		top->split[lvl-1]++;
+		anplan(pl, top, LEFTCHILD(cell), lvl+1, off);
+		anplan(pl, top, RIGHTCHILD(cell), lvl+1, off + pl->s->h.memsz / (1ULL << lvl));
+		return;
+	}
+	if ((pl->nsegs & (pl->nsegs - 1)) == 0) {
+		sg = realloc(pl->segs, (pl->nsegs ? pl->nsegs * 2 : 1) * sizeof(*sg));
+		if (sg == NULL) {
+			err(EXIT_FAILURE, "analyze");
+		}
+		pl->segs = sg;
+	}
+	sg = &pl->segs[pl->nsegs++];
+	memset(sg, 0, sizeof(*sg));
+	sg->cell = cell;
+	sg->lvl = lvl;
+	sg->off = off;
+}
+
+static void *
+anworker(void *arg)
+{
+	struct anpool *pl = arg;
+	struct anseg *sg;
+	size_t i;
+	while ((i = __atomic_fetch_add(&pl->next, 1, __ATOMIC_RELAXED)) < pl->nsegs) {
+		sg = &pl->segs[i];
+		anwalk(pl->s, &sg->res, sg->cell, sg->lvl, sg->off);
+	}
+	return NULL;
+}
+
+static int
+anload(const char *path, struct ansnap *s)
+{
+	FILE *f = fopen(path, "r");
+	uint64_t need;
+	if (f == NULL) {
+		warn("%s", path);
+		return -1;
+	}
+	if (fread(&s->h, sizeof(s->h), 1, f) != 1 ||
+	    memcmp(s->h.magic, BUDSNAPMAGIC, sizeof(s->h.magic)) != 0) {
+		warnx("%s is not a budalloc snapshot", path);
+		fclose(f);
+		return -1;
+	}
+	need = (((1ULL << s->h.levels) - 1) * 2 + 7) / 8;
+	if (s->h.levels == 0 || s->h.levels > ANMAXLVLS || s->h.bitbytes < need) {
+		warnx("%s: bad geometry, %u levels in %u bytes", path, s->h.levels, s->h.bitbytes);
+		fclose(f);
+		return -1;
+	}
+	if ((s->bits = malloc(s->h.bitbytes)) == NULL ||
+	    fread(s->bits, 1, s->h.bitbytes, f) != s->h.bitbytes) {
+		warnx("%s: short snapshot", path);
+		free(s->bits);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* fraction in use of each of n equal address buckets, from the free runs */
+static double *
+anheat(const struct ansnap *s, const struct anres *r, size_t n)
+{
+	double *heat = malloc(n * sizeof(*heat)), bsz = (double)s->h.memsz / n;
+	double lo, hi, a, e;
+	size_t i, k;
+	if (heat == NULL) {
+		err(EXIT_FAILURE, "analyze");
+	}
+	for (k = 0; k < n; k++) {
+		heat[k] = 1.0;
+	}
+	for (i = 0; i < r->nruns; i++) {
+		lo = r->runs[i].off;
+		hi = lo + r->runs[i].len;
+		for (k = lo / bsz; k < n && k * bsz < hi; k++) {
+			a = k * bsz > lo ? k * bsz : lo;
+			e = (k+1) * bsz < hi ? (k+1) * bsz : hi;
+			heat[k] -= (e - a) / bsz;
+		}
+	}
+	return heat;
+}
+
+/*
+ * report per level occupancy, fragmentation and free runs of a snapshot.
+ * maxruns caps how many free runs are listed, cols > 0 adds a text heat
+ * map that many characters wide and image names a pgm file to write a
+ * 256 wide heat map to, darker is fuller.
+ */
+int
+analyze(const char *path, int nthreads, size_t maxruns, int cols, const char *image)
+{
+	static const char shades[] = " .:-=+*#%@";
+	struct ansnap s;
+	struct anpool pl;
+	struct anres top, all;
+	pthread_t *th;
+	double *heat;
+	FILE *img;
+	size_t i, j, n;
+	uint32_t lvl;
+	int t;
+	if (anload(path, &s) == -1) {
+		return EXIT_FAILURE;
+	}
+	memset(&pl, 0, sizeof(pl));
+	memset(&top, 0, sizeof(top));
+	pl.s = &s;
+	/* enough subtrees to keep every thread busy, but not tiny ones */
+	for (pl.split = 1; pl.split < (int)s.h.levels - 8 && (1 << (pl.split-1)) < 16 * nthreads; pl.split++)
+		;
+	anplan(&pl, &top, 1, 1, 0);
+	th = calloc(nthreads, sizeof(*th));
+	for (t = 0; t < nthreads; t++) {
+		if (th == NULL || pthread_create(&th[t], NULL, anworker, &pl) != 0) {
+			break;
+		}
+	}
+	anworker(&pl);
+	while (--t >= 0) {
+		pthread_join(th[t], NULL);
+	}
+	free(th);
+
+	all = top;
+	for (i = 0; i < pl.nsegs; i++) {
+		struct anres *r = &pl.segs[i].res;
+		for (lvl = 0; lvl < s.h.levels; lvl++) {
+			all.full[lvl] += r->full[lvl];
+			all.split[lvl] += r->split[lvl];
+			all.free[lvl] += r->free[lvl];
+		}
+		all.usedbytes += r->usedbytes;
+		all.freebytes += r->freebytes;
+		if (r->largest > all.largest) {
+			all.largest = r->largest;
+		}
+		for (j = 0; j < r->nruns; j++) {
+			anaddrun(&all, r->runs[j].off, r->runs[j].len);
+		}
+		free(r->runs);
+	}
+	free(pl.segs);
+
+	printf("snapshot %s: %u levels size:%llu inuse:%llu requested:%llu free:%llu\n", path,
+		s.h.levels, (unsigned long long)s.h.memsz, (unsigned long long)s.h.inuse,
+		(unsigned long long)s.h.requested, (unsigned long long)s.h.unused);
+	for (lvl = 0; lvl < s.h.levels; lvl++) {
+		printf("level %u\tblocksz:%llu\tfull:%llu\tsplit:%llu\tfree:%llu\n", lvl+1,
+			(unsigned long long)(s.h.memsz / (1ULL << lvl)),
+			(unsigned long long)all.full[lvl], (unsigned long long)all.split[lvl],
+			(unsigned long long)all.free[lvl]);
+	}
+	printf("used:%llu\tfree:%llu\tlargest free block:%llu\tfragmentation:%.4f\n",
+		(unsigned long long)all.usedbytes, (unsigned long long)all.freebytes,
+		(unsigned long long)all.largest,
+		all.freebytes ? 1.0 - (double)all.largest / all.freebytes : 0.0);
+	printf("%zu free runs\n", all.nruns);
+	for (i = 0; i < all.nruns && i < maxruns; i++) {
+		printf("  [%llu, %llu)\t%llu\n", (unsigned long long)all.runs[i].off,
+			(unsigned long long)(all.runs[i].off + all.runs[i].len),
+			(unsigned long long)all.runs[i].len);
+	}
+	if (all.nruns > maxruns) {
+		printf("  ... %zu more\n", all.nruns - maxruns);
+	}
+	if (cols > 0) {
+		heat = anheat(&s, &all, cols);
+		putchar('|');
+		for (t = 0; t < cols; t++) {
+			putchar(shades[(int)(heat[t] * (sizeof(shades) - 2) + 0.5)]);
+		}
+		printf("|\n");
+		free(heat);
+	}
+	if (image != NULL) {
+		n = 256 * 256;
+		heat = anheat(&s, &all, n);
+		if ((img = fopen(image, "w")) == NULL) {
+			warn("%s", image);
+		} else {
+			fprintf(img, "P5\n256 256\n255\n");
+			for (i = 0; i < n; i++) {
+				fputc(255 - (int)(heat[i] * 255 + 0.5), img);
+			}
+			fclose(img);
+		}
+		free(heat);
+	}
+	free(all.runs);
+	free(s.bits);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * non interactive version of the repl for scripted experiments and
+ * regression corpora. it only deals in offsets so b doesn't need an
+ * arena behind it. reads one command per line from f, no prompts:
+ *   A size     allocate, the n-th A (counting from 0) is handle n
+ *   F handle   free what the n-th A returned
+ *   P S H L Q  print, stats, level histogram, list blocks, stop
+ * blank lines and lines starting with # are skipped. allocs and frees
+ * print nothing, a summary of them goes out at the end.
+ * when ref isn't NULL every alloc and free also goes to ref, which walks
+ * its tree with the recursive engine, and to the compact tree cref. all
+ * of them have to return the same and leave the same counters behind, b
+ * and ref the same bits, and cref has to expand to those bits every
+ * 1024 lines and at the end. the first command where they don't stops
+ * the run.
+ */
+static bool
+agree(buddy_allocator_t *b, buddy_allocator_t *ref, buddy_compact_t *cref,
+    bool same, size_t lineno, bool full)
+{
+	static buddy_allocator_t tree;
+	if (same && b->inuse == ref->inuse && b->requested == ref->requested &&
+	    memcmp(b->bits, ref->bits, BITFIELDBYTES) == 0 &&
+	    b->inuse == cref->inuse && b->requested == cref->requested) {
+		if (!full) {
+			return true;
+		}
+		buddy_compact_expand(cref, &tree);
+		if (memcmp(b->bits, tree.bits, BITFIELDBYTES) == 0) {
+			return true;
+		}
+	}
+	warnx("line %zu: the engines disagree", lineno);
+	return false;
+}
+
+int
+batch(buddy_allocator_t *b, buddy_allocator_t *ref, buddy_compact_t *cref, FILE *f)
+{
+	size_t cap = 0, nh = 0, aok = 0, afail = 0, nfree = 0, badfree = 0, lineno = 0;
+	size_t *h = NULL, *nhp;
+	char *line = NULL, *p, *ep;
+	size_t linecap = 0;
+	unsigned long long v;
+	int ret = EXIT_SUCCESS, r;
+	bool quit = false;
+	while (!quit && getline(&line, &linecap, f) != -1) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '\n' || *p == '\0' || *p == '#') {
+			continue;
+		}
+		switch (*p) {
+		case 'A':
+		case 'F':
+			v = strtoull(p + 1, &ep, 10);
+			if (ep == p + 1) {
+				warnx("line %zu: missing number", lineno);
+				ret = EXIT_FAILURE;
+				break;
+			}
+			if (*p == 'F') {
+				if (v >= nh || h[v] == BUDDY_NOOFF) {
+					badfree++;
+					break;
+				}
+				r = buddy_offset_free(b, h[v]);
+				if (ref != NULL && !agree(b, ref, cref, r == buddy_offset_free(ref, h[v]) &&
+				    r == buddy_compact_free(cref, h[v]), lineno, lineno % 1024 == 0)) {
+					ret = EXIT_FAILURE;
+					goto out;
+				}
+				h[v] = BUDDY_NOOFF;
+				nfree++;
+				break;
+			}
+			if (nh == cap) {
+				cap = cap ? cap * 2 : 1024;
+				if ((nhp = realloc(h, cap * sizeof(*h))) == NULL) {
+					err(EXIT_FAILURE, "batch");
+				}
+				h = nhp;
+			}
+			h[nh] = buddy_offset_alloc(b, v);
+			if (ref != NULL && !agree(b, ref, cref, h[nh] == buddy_offset_alloc(ref, v) &&
+			    h[nh] == buddy_compact_alloc(cref, v), lineno, lineno % 1024 == 0)) {
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+			if (h[nh++] != BUDDY_NOOFF) {
+				aok++;
+			} else {
+				afail++;
+			}
+			break;
+		case 'P':
+			buddy_allocator_print(b);
+			break;
+		case 'S':
+			buddy_allocator_print_stats(b);
+			break;
+		case 'H':
+			buddy_allocator_print_levels(b);
+			break;
+		case 'L':
+			buddy_allocator_foreach(b, printblock, b);
+			break;
+		case 'Q':
+			/* still compare the final trees below */
+			quit = true;
+			break;
+		default:
+			warnx("line %zu: unknown command %c", lineno, *p);
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	if (ref != NULL && !agree(b, ref, cref, true, lineno, true)) {
+		ret = EXIT_FAILURE;
+	}
+out:
+	printf("allocs:%zu ok:%zu failed:%zu frees:%zu bad frees:%zu\n",
+		aok + afail, aok, afail, nfree, badfree);
+	free(line);
+	free(h);
+	return ret;
+}
+
+void
+usage()
+{
+	fprintf(stderr, "usage:budalloc [-b cmdfile [-d]] bytenumber\n"
+			"      budalloc -m shmname\n"
+			"      budalloc -a snapshot [-j threads] [-n runs] [-w cols] [-i image.pgm]\n");
+}
+
+/* print one consistent reading of the stats page another process publishes */
+int
+monitor(const char *name)
+{
+	const struct buddy_shm_page *pg;
+	struct buddy_shm_page snap;
+	uint32_t i;
+	if ((pg = buddy_shm_open(name)) == NULL) {
+		warn("failed to map %s", name);
+		return EXIT_FAILURE;
+	}
+	if (buddy_shm_read(pg, &snap) == -1) {
+		if (errno == EAGAIN) {
+			warnx("%s is stuck halfway through an update", name);
+		} else {
+			warnx("%s is not a budalloc stats page", name);
+		}
+		buddy_shm_close(pg);
+		return EXIT_FAILURE;
+	}
+	printf("seq:%llu\tsize:%llu\tinuse:%llu\trequested:%llu\tfree:%llu\n",
+		(unsigned long long)snap.seq, (unsigned long long)snap.memsz,
+		(unsigned long long)snap.inuse, (unsigned long long)snap.requested,
+		(unsigned long long)snap.unused);
+	for (i = 0; i < snap.levels; i++) {
+		printf("level %u\tfull:%llu\n", i+1, (unsigned long long)snap.lvlfull[i]);
+	}
+	buddy_shm_close(pg);
+	return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int res;
+	long long in;
+	char *ep;
+	buddy_allocator_t *b, *ref = NULL;
+	buddy_compact_t *cref = NULL;
+	bool diff = false;
+	char *shm = NULL, *snap = NULL, *image = NULL, *cmds = NULL;
+	FILE *cmdf = NULL;
+	int ch, nthreads = sysconf(_SC_NPROCESSORS_ONLN), cols = 0;
+	size_t maxruns = 32;
+	while ((ch = getopt(argc, argv, "b:dm:a:j:n:w:i:")) != -1) {
+		switch (ch) {
+		case 'b':
+			cmds = optarg;
+			break;
+		case 'd':
+			diff = true;
+			break;
+		case 'm':
+			shm = optarg;
+			break;
+		case 'a':
+			snap = optarg;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			maxruns = strtoull(optarg, NULL, 10);
+			break;
+		case 'w':
+			cols = atoi(optarg);
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (shm != NULL) {
+		return monitor(shm);
+	}
+	if (snap != NULL) {
+		return analyze(snap, nthreads > 0 ? nthreads : 1, maxruns, cols, image);
+	}
+	if (argc != 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (cmds != NULL) {
+		cmdf = strcmp(cmds, "-") == 0 ? stdin : fopen(cmds, "r");
+		if (cmdf == NULL) {
+			err(EXIT_FAILURE, "%s", cmds);
+		}
+	}
+	in = strtoll(argv[0], &ep, 10);
+        if (argv[0][0] == '\0' || *ep != '\0') {
+		usage();
+	}
+        if (errno == ERANGE && (in == LLONG_MAX || in == LLONG_MIN)) {
+		warnx("num range");
+	}
+
+	if (in > SIZE_MAX || in <= 0) {
+		warnx("invalid arena size requested\n");
+	}
+	/* batch mode runs on offsets alone, no need to reserve the arena */
+	void *arena = cmdf != NULL ? NULL : malloc(in);
+	if (arena == NULL && cmdf == NULL) {
+		warnx("failed to allocate %lld bytes\n", in);
+	}
+	b = buddy_allocator_create(arena, in);
+#ifdef BUDPROF
+	/* the repl does a handful of allocations, sample all of them */
+	buddy_allocator_prof_start(b, 1);
+#endif
+	if (getenv("BUDALLOC_SIGDUMP") != NULL) {
+		buddy_allocator_sigdump(b, SIGUSR1, getenv("BUDALLOC_SIGDUMP"), true);
+	}
+	if (getenv("BUDALLOC_SHM") != NULL &&
+	    buddy_allocator_shm_publish(b, getenv("BUDALLOC_SHM")) == -1) {
+		warn("failed to publish stats to %s", getenv("BUDALLOC_SHM"));
+	}
+	if (cmdf != NULL && diff) {
+		/* check the default engine against the recursive one and the compact tree */
+		ref = buddy_allocator_create(NULL, in);
+		buddy_allocator_engine(ref, BUDDY_ENGINE_RECURSIVE);
+		if ((cref = malloc(sizeof(*cref))) == NULL) {
+			err(EXIT_FAILURE, "compact tree");
+		}
+		buddy_compact_init(cref, in);
+	}
+	if (cmdf != NULL) {
+		res = batch(b, ref, cref, cmdf);
+	} else {
+		repl(b);
+		res = EXIT_SUCCESS;
+	}
+	buddy_allocator_shm_unpublish(b, getenv("BUDALLOC_SHM"));
+	buddy_allocator_destroy(b);
+	buddy_allocator_destroy(ref);
+	free(cref);
+	free(arena);
+	return res;
+}
@@ -0,0 +1,206 @@
+/*
+ * budbench times the hot paths of the allocator on a few fixed workloads
+ * and prints nanoseconds per alloc/free pair. make bench builds it twice,
+ * budbench against libbudalloc.a and budbench_single with the single
+ * header build, so the difference is what inlining into the caller buys.
+ * every workload runs on each engine and on the compact tree. all
+ * workloads are offset only, no arena is touched.
+ */
+
+/* the single header has to come before any system header */
+#ifdef BUDBENCH_SINGLE
+#include "budalloc_single.h"
+#define BENCHBUILD "single"
+#else
+#include "budalloc.h"
+#define BENCHBUILD "lib"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCHARENA (1UL << 24)
+#define BENCHLIVE  1024
+#define BENCHBURST 64
+
+static size_t live[BENCHLIVE], livesz[BENCHLIVE];
+static uint64_t rnd = 88172645463325252ULL;
+
+static inline uint64_t
+xorshift(void)
+{
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	return rnd;
+}
+
+/* set while the workloads run on the compact tree instead of b */
+static buddy_compact_t *compact;
+
+static inline size_t
+balloc(buddy_allocator_t *b, size_t sz)
+{
+	return compact != NULL ? buddy_compact_alloc(compact, sz) : buddy_offset_alloc(b, sz);
+}
+
+static inline int
+bfree(buddy_allocator_t *b, size_t off)
+{
+	return compact != NULL ? buddy_compact_free(compact, off) : buddy_offset_free(b, off);
+}
+
+static inline int
+bfreesized(buddy_allocator_t *b, size_t off, size_t sz)
+{
+	return compact != NULL ? buddy_compact_free_sized(compact, off, sz) :
+	    buddy_offset_free_sized(b, off, sz);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* alloc and immediately free the same small block */
+static void
+pairs(buddy_allocator_t *b, long n)
+{
+	long i;
+	for (i = 0; i < n; i++) {
+		bfree(b, balloc(b, 64));
+	}
+}
+
+/* a burst of mixed sizes, freed in reverse */
+static void
+bursts(buddy_allocator_t *b, long n)
+{
+	long i;
+	int j;
+	for (i = 0; i < n; i += BENCHBURST) {
+		for (j = 0; j < BENCHBURST; j++) {
+			live[j] = balloc(b, 64 << (j % 8));
+		}
+		while (j-- > 0) {
+			bfree(b, live[j]);
+		}
+	}
+}
+
+/* same bursts, freed with the size that was asked for */
+static void
+sizedbursts(buddy_allocator_t *b, long n)
+{
+	long i;
+	int j;
+	for (i = 0; i < n; i += BENCHBURST) {
+		for (j = 0; j < BENCHBURST; j++) {
+			live[j] = balloc(b, 64 << (j % 8));
+		}
+		while (j-- > 0) {
+			bfreesized(b, live[j], 64 << (j % 8));
+		}
+	}
+}
+
+/* a steady heap of BENCHLIVE blocks, replace a random one each time */
+static void
+churn(buddy_allocator_t *b, long n)
+{
+	long i;
+	int j;
+	for (j = 0; j < BENCHLIVE; j++) {
+		livesz[j] = 1 + xorshift() % 8192;
+		live[j] = balloc(b, livesz[j]);
+	}
+	for (i = 0; i < n; i++) {
+		j = xorshift() % BENCHLIVE;
+		if (live[j] != BUDDY_NOOFF) {
+			bfree(b, live[j]);
+		}
+		livesz[j] = 1 + xorshift() % 8192;
+		live[j] = balloc(b, livesz[j]);
+	}
+	for (j = 0; j < BENCHLIVE; j++) {
+		if (live[j] != BUDDY_NOOFF) {
+			bfree(b, live[j]);
+		}
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(buddy_allocator_t *, long);
+	long n;
+} workloads[] = {
+	{ "pairs",  pairs,       4000000 },
+	{ "bursts", bursts,      2000000 },
+	{ "sized",  sizedbursts, 2000000 },
+	{ "churn",  churn,        500000 },
+};
+
+static const struct {
+	const char *name;
+	int engine;
+} engines[] = {
+	{ "iterative", BUDDY_ENGINE_ITERATIVE },
+	{ "recursive", BUDDY_ENGINE_RECURSIVE },
+	{ "freemap",   BUDDY_ENGINE_FREEMAP },
+	{ "compact",   -1 },
+};
+
+#define NELEM(a) (sizeof(a) / sizeof((a)[0]))
+
+int
+main(int argc, char *argv[])
+{
+	buddy_allocator_t *b;
+	buddy_compact_t *c;
+	double t, best;
+	size_t i, e;
+	int rounds = argc > 1 ? atoi(argv[1]) : 3, r;
+	if ((b = buddy_allocator_create(NULL, BENCHARENA)) == NULL ||
+	    (c = malloc(sizeof(*c))) == NULL) {
+		return EXIT_FAILURE;
+	}
+	buddy_compact_init(c, BENCHARENA);
+	printf("%s build, %d levels, %lu byte arena, ns per alloc and free\n",
+	    BENCHBUILD, TOTLVLS, BENCHARENA);
+	printf("%-8s", "");
+	for (e = 0; e < NELEM(engines); e++) {
+		printf(" %10s", engines[e].name);
+	}
+	printf("\n");
+	for (i = 0; i < NELEM(workloads); i++) {
+		printf("%-8s", workloads[i].name);
+		for (e = 0; e < NELEM(engines); e++) {
+			compact = engines[e].engine == -1 ? c : NULL;
+			if (compact == NULL && buddy_allocator_engine(b, engines[e].engine) == -1) {
+				return EXIT_FAILURE;
+			}
+			for (r = 0, best = 0; r < rounds; r++) {
+				t = now();
+				workloads[i].run(b, workloads[i].n);
+				t = (now() - t) / workloads[i].n;
+				if (r == 0 || t < best) {
+					best = t;
+				}
+			}
+			printf(" %10.1f", best);
+		}
+		printf("\n");
+	}
+	if (b->inuse != 0 || c->inuse != 0) {
+		fprintf(stderr, "leaked %zu bytes\n", b->inuse + c->inuse);
+		return EXIT_FAILURE;
+	}
+	buddy_allocator_destroy(b);
+	free(c);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+/*
+ * the cell encoding of the bittree, shared by the allocator and the tools
+ * that read its snapshots. not part of the public interface.
+ */
+#ifndef BUDBITS_H
+#define BUDBITS_H
+
+#define TOTCELLSFORLVL(x, y) { int _x = 1; int _cnt = 0; (y) = 1; \
+				 while(++_cnt < (x)) {_x<<=1; (y) += _x; }}
+/*
+ * for 16 levels we need 65535 cells, with 2 bits per cell we need 16384 bytes 
+ */
+#define SETBIT(A,k)      ((A)[((k)/8)] |= (1 << ((k)%8)))
+#define CLEARBIT(A,k)    ((A)[((k)/8)] &= ~(1 << ((k)%8)))            
+#define TESTBIT(A,k)     ((A)[((k)/8)] & (1 << ((k)%8)))
+#define FREECELL(A,c)    (CLEARBIT((A),(2*(c)-1)) && CLEARBIT((A), (2*(c)-2))) /* 00 means free */
+#define ALLOCSPLIT(A,c)  (SETBIT((A),(2*(c)-1)) && CLEARBIT((A), (2*(c)-2)))  /* 10 means split */
+#define ALLOCCELL(A,c)   (SETBIT((A),(2*(c)-1)) && SETBIT((A), (2*(c)-2))) /* 11 means full */
+#define ISFULL(A,c)      (TESTBIT((A),(2*(c)-1)) && TESTBIT((A), (2*(c)-2))) /* tests for 11 */
+#define ISSPLIT(A,c)     (TESTBIT((A),(2*(c)-1)) && !TESTBIT((A), (2*(c)-2))) /* tests for 10 */
+#define ISFREE(A,c)      (!TESTBIT((A),(2*(c)-1)) && !TESTBIT((A), (2*(c)-2))) /* tests for 00 */
+#define LEFTCHILD(c)     (2 * (c))
+#define RIGHTCHILD(c)    ((2 * (c)) + 1)
+
+#endif /* BUDBITS_H */
@@ -0,0 +1,144 @@
+/*
+ * c++ adapters for budalloc. budalloc::memory_resource puts a
+ * buddy_allocator_t behind std::pmr and budalloc::BuddyAllocator<T> does
+ * the same for plain stl containers. both always know the size of what
+ * they give back so they free with buddy_offset_free_sized(), which goes
+ * straight down to the level of the block.
+ *
+ *   buddy_allocator_t *b = buddy_allocator_create(arena, sz);
+ *   budalloc::memory_resource mr(b);
+ *   std::pmr::map<int, int> m(&mr);
+ *   std::list<int, budalloc::BuddyAllocator<int>> l{budalloc::BuddyAllocator<int>(b)};
+ *
+ * blocks are aligned to their size from the start of the arena, so as long
+ * as the arena is aligned at least as strictly as the types that go in it
+ * (page aligned arenas are, please be that person) alignment comes for
+ * free by asking for at least align bytes. neither adapter is thread safe,
+ * just like the allocator under it.
+ */
+#ifndef BUDPMR_HPP
+#define BUDPMR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "budalloc.h"
+
+namespace budalloc {
+
+/* the block size that satisfies both the size and the alignment */
+inline std::size_t
+blocksize(std::size_t bytes, std::size_t align) noexcept
+{
+	return bytes > align ? bytes : align;
+}
+
+inline void *
+allocate(buddy_allocator_t *b, std::size_t bytes, std::size_t align)
+{
+	void *p = buddy_allocator_alloc(b, blocksize(bytes, align));
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	if (reinterpret_cast<std::uintptr_t>(p) % align != 0) {
+		buddy_allocator_free(b, p);
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+inline void
+deallocate(buddy_allocator_t *b, void *p, std::size_t bytes, std::size_t align) noexcept
+{
+	buddy_offset_free_sized(b, static_cast<char *>(p) - static_cast<char *>(b->memstart),
+	    blocksize(bytes, align));
+}
+
+class memory_resource : public std::pmr::memory_resource {
+public:
+	explicit memory_resource(buddy_allocator_t *b) noexcept : b_(b) {}
+
+	buddy_allocator_t *
+	allocator() const noexcept
+	{
+		return b_;
+	}
+
+private:
+	void *
+	do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		return budalloc::allocate(b_, bytes, align);
+	}
+
+	void
+	do_deallocate(void *p, std::size_t bytes, std::size_t align) override
+	{
+		budalloc::deallocate(b_, p, bytes, align);
+	}
+
+	bool
+	do_is_equal(const std::pmr::memory_resource &o) const noexcept override
+	{
+		const memory_resource *r = dynamic_cast<const memory_resource *>(&o);
+		return r != nullptr && r->b_ == b_;
+	}
+
+	buddy_allocator_t *b_;
+};
+
+template <class T>
+class BuddyAllocator {
+public:
+	using value_type = T;
+
+	explicit BuddyAllocator(buddy_allocator_t *b) noexcept : b_(b) {}
+
+	template <class U>
+	BuddyAllocator(const BuddyAllocator<U> &o) noexcept : b_(o.allocator()) {}
+
+	T *
+	allocate(std::size_t n)
+	{
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+			throw std::bad_array_new_length();
+		}
+		return static_cast<T *>(budalloc::allocate(b_, n * sizeof(T), alignof(T)));
+	}
+
+	void
+	deallocate(T *p, std::size_t n) noexcept
+	{
+		budalloc::deallocate(b_, p, n * sizeof(T), alignof(T));
+	}
+
+	buddy_allocator_t *
+	allocator() const noexcept
+	{
+		return b_;
+	}
+
+private:
+	buddy_allocator_t *b_;
+};
+
+template <class T, class U>
+bool
+operator==(const BuddyAllocator<T> &a, const BuddyAllocator<U> &b) noexcept
+{
+	return a.allocator() == b.allocator();
+}
+
+template <class T, class U>
+bool
+operator!=(const BuddyAllocator<T> &a, const BuddyAllocator<U> &b) noexcept
+{
+	return !(a == b);
+}
+
+} /* namespace budalloc */
+
+#endif /* BUDPMR_HPP */
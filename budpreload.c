@@ -0,0 +1,317 @@
+/*
+ * budpreload is a malloc replacement on top of budalloc, meant to be
+ * LD_PRELOADed into unmodified binaries to compare them against the libc
+ * allocator:
+ *
+ *   LD_PRELOAD=./libbudalloc_preload.so ls -l
+ *
+ * the whole heap is one arena of BUDALLOC_ARENA_MB megabytes (1024 by
+ * default, and at least what gives 16 byte minimum blocks, 128 with 24
+ * levels) reserved at the first call and aligned to its own size, so
+ * every block is naturally aligned to its size and posix_memalign is just
+ * a bigger alloc. the size classes are the levels of the tree. the small
+ * ones are served from per-thread caches of free blocks that are refilled
+ * from and flushed to the shared tree in batches under one lock. a byte
+ * per minimum block remembers which level a block was handed out on, so
+ * free and malloc_usable_size never have to walk the tree.
+ */
+
+#include "budalloc.c"
+
+#define BPEXPORT      __attribute__((visibility("default")))
+#define BPARENAMB     1024
+#define BPMINBLK      16 /* alignof(max_align_t), the smallest block malloc may return */
+#define BPCACHEMAX    (32 * 1024) /* largest block size that goes through the caches */
+#define BPCACHECAP    32
+#define BPCACHECLASS  16
+
+struct bpcache {
+	uint32_t n[BPCACHECLASS];
+	uint32_t blk[BPCACHECLASS][BPCACHECAP]; /* offsets in minimum blocks */
+};
+
+static buddy_allocator_t bpheap;
+static pthread_mutex_t bplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t bponce = PTHREAD_ONCE_INIT;
+static pthread_key_t bpkey;
+static char *bparena;
+static unsigned char *bplvl;
+static int bpminshift, bpcached;
+static __thread struct bpcache bptc __attribute__((tls_model("initial-exec")));
+static __thread bool bptcreg __attribute__((tls_model("initial-exec")));
+
+static void bpthreadexit(void *);
+
+static void
+bpprefork(void)
+{
+	pthread_mutex_lock(&bplock);
+}
+
+static void
+bppostfork(void)
+{
+	pthread_mutex_unlock(&bplock);
+}
+
+static void
+bpinit(void)
+{
+	size_t mb = BPARENAMB, sz, minblk;
+	char *e = getenv("BUDALLOC_ARENA_MB"), *m;
+	uintptr_t base;
+	if (e != NULL && atol(e) > 0) {
+		mb = atol(e);
+	}
+	/* round down to a power of two so that every level is shifts only */
+	for (sz = 1; sz * 2 <= mb; sz *= 2)
+		;
+	sz <<= 20;
+	/* a smaller arena would cut the minimum block below the malloc alignment */
+	if (sz < (size_t)BPMINBLK << (TOTLVLS-1)) {
+		sz = (size_t)BPMINBLK << (TOTLVLS-1);
+	}
+	minblk = sz >> (TOTLVLS-1);
+	m = mmap(NULL, 2 * sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED) {
+		return;
+	}
+	base = ((uintptr_t)m + sz - 1) & ~(uintptr_t)(sz - 1);
+	if (base != (uintptr_t)m) {
+		munmap(m, base - (uintptr_t)m);
+	}
+	munmap((char *)base + sz, (uintptr_t)m + sz - base);
+	bplvl = mmap(NULL, sz / minblk, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (bplvl == MAP_FAILED) {
+		munmap((char *)base, sz);
+		return;
+	}
+	bparena = (char *)base;
+	bpminshift = __builtin_ctzll(minblk);
+	for (bpcached = 0; bpcached < BPCACHECLASS && (minblk << bpcached) <= BPCACHEMAX; bpcached++)
+		;
+	buddy_allocator_init(&bpheap, bparena, sz);
+	pthread_key_create(&bpkey, bpthreadexit);
+	pthread_atfork(bpprefork, bppostfork, bppostfork);
+}
+
+/*
+ * class of a request, 0 is the minimum block and class c is 2^c of them.
+ * the tree level it lands on is TOTLVLS - c.
+ */
+static inline int
+bpclass(size_t sz)
+{
+	if (sz <= (1UL << bpminshift)) {
+		return 0;
+	}
+	return 64 - __builtin_clzll(sz - 1) - bpminshift;
+}
+
+/* take a block of class c off the tree, bplock held */
+static inline size_t
+bptake(int c)
+{
+	size_t off = buddy_offset_alloc(&bpheap, 1UL << (bpminshift + c));
+	if (off != BUDDY_NOOFF) {
+		bplvl[off >> bpminshift] = c;
+	}
+	return off;
+}
+
+static void
+bpflush(struct bpcache *tc, int c, uint32_t keep)
+{
+	pthread_mutex_lock(&bplock);
+	while (tc->n[c] > keep) {
+		buddy_offset_free(&bpheap, (size_t)tc->blk[c][--tc->n[c]] << bpminshift);
+	}
+	pthread_mutex_unlock(&bplock);
+}
+
+static void
+bpthreadexit(void *arg)
+{
+	int c;
+	(void)arg;
+	for (c = 0; c < bpcached; c++) {
+		bpflush(&bptc, c, 0);
+	}
+	/*
+	 * destructors that run after this one may still free, those go
+	 * straight to the tree. an alloc registers the cache again so the
+	 * key gets another round of destructors.
+	 */
+	bptcreg = false;
+}
+
+static void *
+bpalloc(size_t sz)
+{
+	struct bpcache *tc = &bptc;
+	size_t off;
+	int c;
+	pthread_once(&bponce, bpinit);
+	if (bparena == NULL || sz > bpheap.memsz) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	c = bpclass(sz ? sz : 1);
+	if (c < bpcached) {
+		if (!bptcreg) {
+			bptcreg = true;
+			pthread_setspecific(bpkey, tc);
+		}
+		if (tc->n[c] == 0) {
+			/* refill half the cache under one lock */
+			pthread_mutex_lock(&bplock);
+			while (tc->n[c] < BPCACHECAP/2 && (off = bptake(c)) != BUDDY_NOOFF) {
+				tc->blk[c][tc->n[c]++] = off >> bpminshift;
+			}
+			pthread_mutex_unlock(&bplock);
+			if (tc->n[c] == 0) {
+				errno = ENOMEM;
+				return NULL;
+			}
+		}
+		return bparena + ((size_t)tc->blk[c][--tc->n[c]] << bpminshift);
+	}
+	pthread_mutex_lock(&bplock);
+	off = bptake(c);
+	pthread_mutex_unlock(&bplock);
+	if (off == BUDDY_NOOFF) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return bparena + off;
+}
+
+static inline bool
+bpours(void *p)
+{
+	return bparena != NULL && (char *)p >= bparena && (char *)p < bparena + bpheap.memsz;
+}
+
+BPEXPORT void
+free(void *p)
+{
+	struct bpcache *tc = &bptc;
+	size_t off;
+	int c;
+	/* pointers that aren't ours can't be given back to anyone, drop them */
+	if (p == NULL || !bpours(p)) {
+		return;
+	}
+	off = (char *)p - bparena;
+	c = bplvl[off >> bpminshift];
+	if (c < bpcached && bptcreg) {
+		if (tc->n[c] == BPCACHECAP) {
+			bpflush(tc, c, BPCACHECAP/2);
+		}
+		tc->blk[c][tc->n[c]++] = off >> bpminshift;
+		return;
+	}
+	pthread_mutex_lock(&bplock);
+	buddy_offset_free(&bpheap, off);
+	pthread_mutex_unlock(&bplock);
+}
+
+BPEXPORT void *
+malloc(size_t sz)
+{
+	return bpalloc(sz);
+}
+
+BPEXPORT size_t
+malloc_usable_size(void *p)
+{
+	if (p == NULL || !bpours(p)) {
+		return 0;
+	}
+	return 1UL << (bpminshift + bplvl[((char *)p - bparena) >> bpminshift]);
+}
+
+BPEXPORT void *
+calloc(size_t n, size_t sz)
+{
+	void *p;
+	if (sz != 0 && n > SIZE_MAX / sz) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((p = bpalloc(n * sz)) != NULL) {
+		memset(p, 0, n * sz);
+	}
+	return p;
+}
+
+BPEXPORT void *
+realloc(void *p, size_t sz)
+{
+	size_t have;
+	void *n;
+	if (p == NULL) {
+		return bpalloc(sz);
+	}
+	if (sz == 0) {
+		free(p);
+		return NULL;
+	}
+	have = malloc_usable_size(p);
+	/* stay put unless it no longer fits or would waste more than half */
+	if (sz <= have && (sz > have / 2 || have == 1UL << bpminshift)) {
+		return p;
+	}
+	if ((n = bpalloc(sz)) == NULL) {
+		return NULL;
+	}
+	memcpy(n, p, sz < have ? sz : have);
+	free(p);
+	return n;
+}
+
+BPEXPORT int
+posix_memalign(void **memptr, size_t align, size_t sz)
+{
+	void *p;
+	if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+		return EINVAL;
+	}
+	/* blocks are aligned to their size, asking for at least align is enough */
+	if ((p = bpalloc(sz > align ? sz : align)) == NULL) {
+		return ENOMEM;
+	}
+	*memptr = p;
+	return 0;
+}
+
+BPEXPORT void *
+aligned_alloc(size_t align, size_t sz)
+{
+	void *p;
+	int r = posix_memalign(&p, align, sz);
+	if (r != 0) {
+		errno = r;
+		return NULL;
+	}
+	return p;
+}
+
+BPEXPORT void *
+memalign(size_t align, size_t sz)
+{
+	return aligned_alloc(align, sz);
+}
+
+BPEXPORT void *
+valloc(size_t sz)
+{
+	return aligned_alloc(sysconf(_SC_PAGESIZE), sz);
+}
+
+BPEXPORT void *
+pvalloc(size_t sz)
+{
+	size_t pg = sysconf(_SC_PAGESIZE);
+	return aligned_alloc(pg, (sz + pg - 1) / pg * pg);
+}
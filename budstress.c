@@ -0,0 +1,440 @@
+/*
+ * budstress runs the concurrent allocator from several threads and exits
+ * non zero if anything went wrong. make stress builds and runs it as it
+ * is and with thread sanitizer. the workloads:
+ *   cross   threads swap their blocks through a shared table, so most
+ *           frees come from another thread than the alloc, and check
+ *           that the bytes written into a block are still there
+ *   double  threads race to free the same blocks and offsets inside
+ *           them, every block has to be freed exactly once
+ *   wait    producers alloc_wait on a mostly full arena while consumers
+ *           free, none may time out. then a wait on a full arena has to
+ *           time out, and waiters have to wake for a free from another
+ *           thread and for blocks held back in a cpu cache
+ * after each one everything is drained and the tree has to be empty.
+ *   budstress [threads [iterations]]
+ */
+
+#define _GNU_SOURCE
+#include "budalloc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STRESSARENA (1UL << 24)
+#define STRESSK     3
+#define STRESSSLOTS 256
+#define STRESSDBL   512
+#define STRESSRING  64
+#define STRESSMAXT  64
+
+#define FAIL(...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED); \
+} while (0)
+
+static buddy_concurrent_t *c;
+static unsigned char *arena;
+static long nthreads = 4, iters = 100000;
+static int failures;
+
+static inline uint64_t
+xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/* mostly sizes the cpu caches keep, now and then a big one */
+static size_t
+randsize(uint64_t *s)
+{
+	uint64_t r = xorshift(s);
+	if ((r & 15) == 0) {
+		return sizeof(size_t) + (r >> 8) % (STRESSARENA / 256);
+	}
+	return sizeof(size_t) + (r >> 8) % 4096;
+}
+
+static inline unsigned char
+tag(size_t off, size_t sz)
+{
+	return (off ^ sz ^ (off >> 8)) & 0xff;
+}
+
+/* a block starts with its size, the rest is a byte that depends on both */
+static void
+fill(size_t off, size_t sz)
+{
+	*(size_t *)(arena + off) = sz;
+	memset(arena + off + sizeof(size_t), tag(off, sz), sz - sizeof(size_t));
+}
+
+static void
+check(size_t off)
+{
+	size_t sz = *(size_t *)(arena + off), i;
+	if (sz < sizeof(size_t) || sz > STRESSARENA - off) {
+		FAIL("block at %zu: size %zu overwritten\n", off, sz);
+		return;
+	}
+	for (i = sizeof(size_t); i < sz; i += 61) {
+		if (arena[off + i] != tag(off, sz)) {
+			FAIL("block at %zu: byte %zu overwritten\n", off, i);
+			return;
+		}
+	}
+	if (arena[off + sz - 1] != tag(off, sz) && sz > sizeof(size_t)) {
+		FAIL("block at %zu: last byte overwritten\n", off);
+	}
+}
+
+/* drain and check that nothing is left in the tree */
+static void
+checkempty(const char *what)
+{
+	buddy_allocator_t *b;
+	size_t i;
+	buddy_concurrent_drain(c);
+	b = buddy_concurrent_allocator(c);
+	if (b->inuse != 0 || b->unused != b->memsz) {
+		FAIL("%s: %zu bytes still in use\n", what, b->inuse);
+	}
+	for (i = 0; i < BITFIELDBYTES; i++) {
+		if (b->bits[i] != 0) {
+			FAIL("%s: tree not empty at byte %zu\n", what, i);
+			break;
+		}
+	}
+}
+
+static void
+spawn(void *(*fn)(void *), long n, long first)
+{
+	pthread_t t[STRESSMAXT];
+	long i;
+	for (i = 0; i < n; i++) {
+		if ((errno = pthread_create(&t[i], NULL, fn, (void *)(intptr_t)(first + i))) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(t[i], NULL);
+	}
+}
+
+static size_t slot[STRESSSLOTS];
+
+static void *
+cross(void *arg)
+{
+	uint64_t s = (uintptr_t)arg * 0x9e3779b97f4a7c15ULL + 1;
+	size_t off, sz, got;
+	long i;
+	for (i = 0; i < iters; i++) {
+		sz = randsize(&s);
+		/* a full arena is fine, the table holds blocks of other threads */
+		if ((off = buddy_concurrent_alloc(c, sz)) == BUDDY_NOOFF) {
+			continue;
+		}
+		fill(off, sz);
+		got = __atomic_exchange_n(&slot[xorshift(&s) % STRESSSLOTS], off, __ATOMIC_ACQ_REL);
+		if (got != BUDDY_NOOFF) {
+			check(got);
+			if (buddy_concurrent_free(c, got) != 0) {
+				FAIL("cross: free of %zu refused\n", got);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+runcross(void)
+{
+	size_t i;
+	for (i = 0; i < STRESSSLOTS; i++) {
+		slot[i] = BUDDY_NOOFF;
+	}
+	spawn(cross, nthreads, 0);
+	for (i = 0; i < STRESSSLOTS; i++) {
+		if (slot[i] != BUDDY_NOOFF) {
+			check(slot[i]);
+			if (buddy_concurrent_free(c, slot[i]) != 0) {
+				FAIL("cross: free of %zu refused\n", slot[i]);
+			}
+		}
+	}
+	checkempty("cross");
+}
+
+static size_t dbl[STRESSDBL], dblsz[STRESSDBL];
+static int dblok[STRESSDBL];
+
+/* every thread frees every block, starting at a different one */
+static void *
+dfree(void *arg)
+{
+	long id = (intptr_t)arg, i, j;
+	for (i = 0; i < STRESSDBL; i++) {
+		j = (i + id * STRESSDBL / nthreads) % STRESSDBL;
+		if (dblsz[j] > 2 * sizeof(size_t) &&
+		    buddy_concurrent_free(c, dbl[j] + sizeof(size_t)) == 0) {
+			FAIL("double: free inside the block at %zu accepted\n", dbl[j]);
+		}
+		if (buddy_concurrent_free(c, dbl[j]) == 0) {
+			__atomic_fetch_add(&dblok[j], 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+static void
+rundouble(void)
+{
+	uint64_t s = 42;
+	long round, i;
+	for (round = 0; round < iters / 2000 + 1; round++) {
+		for (i = 0; i < STRESSDBL; i++) {
+			dblsz[i] = randsize(&s) / 16 + sizeof(size_t);
+			if ((dbl[i] = buddy_concurrent_alloc(c, dblsz[i])) == BUDDY_NOOFF) {
+				FAIL("double: alloc of %zu failed\n", dblsz[i]);
+				return;
+			}
+			dblok[i] = 0;
+		}
+		spawn(dfree, nthreads, 0);
+		for (i = 0; i < STRESSDBL; i++) {
+			if (dblok[i] != 1) {
+				FAIL("double: block at %zu freed %d times\n", dbl[i], dblok[i]);
+			}
+		}
+		checkempty("double");
+	}
+}
+
+static size_t ring[STRESSRING];
+static long rhead, rtail, timeouts;
+static bool done;
+static pthread_mutex_t rlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcond = PTHREAD_COND_INITIALIZER;
+
+static void *
+producer(void *arg)
+{
+	uint64_t s = (uintptr_t)arg * 0x9e3779b97f4a7c15ULL + 7;
+	struct timespec to = { 10, 0 };
+	size_t off, sz;
+	long i;
+	for (i = 0; i < iters / 10; i++) {
+		sz = (size_t)64 << (xorshift(&s) % 13);
+		if ((off = buddy_concurrent_alloc_wait(c, sz, &to)) == BUDDY_NOOFF) {
+			__atomic_fetch_add(&timeouts, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		fill(off, sz);
+		pthread_mutex_lock(&rlock);
+		while (rhead - rtail >= STRESSRING) {
+			pthread_cond_wait(&rcond, &rlock);
+		}
+		ring[rhead++ % STRESSRING] = off;
+		pthread_cond_broadcast(&rcond);
+		pthread_mutex_unlock(&rlock);
+	}
+	return NULL;
+}
+
+static void *
+consumer(void *arg)
+{
+	size_t off;
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&rlock);
+		while (rtail == rhead && !done) {
+			pthread_cond_wait(&rcond, &rlock);
+		}
+		if (rtail == rhead) {
+			pthread_mutex_unlock(&rlock);
+			return NULL;
+		}
+		off = ring[rtail++ % STRESSRING];
+		pthread_cond_broadcast(&rcond);
+		pthread_mutex_unlock(&rlock);
+		check(off);
+		if (buddy_concurrent_free(c, off) != 0) {
+			FAIL("wait: free of %zu refused\n", off);
+		}
+	}
+}
+
+static void *
+waiter(void *arg)
+{
+	struct timespec to = { 10, 0 };
+	size_t *req = (size_t *)arg;
+	req[1] = buddy_concurrent_alloc_wait(c, req[0], &to);
+	return NULL;
+}
+
+/* a waiter for req[0] bytes, on another cpu than this thread if there is one */
+static void
+startwaiter(pthread_t *t, size_t *req)
+{
+	pthread_attr_t a;
+	cpu_set_t set;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_attr_init(&a);
+	if (ncpu > 1 && sched_getcpu() >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET((sched_getcpu() + 1) % ncpu, &set);
+		pthread_attr_setaffinity_np(&a, sizeof(set), &set);
+	}
+	if ((errno = pthread_create(t, &a, waiter, req)) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	pthread_attr_destroy(&a);
+}
+
+static double
+msec(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static void
+runwait(void)
+{
+	struct timespec to = { 0, 20000000 }, t0, t1;
+	pthread_t t[STRESSMAXT], w;
+	size_t held[4], req[2], off;
+	static size_t blk[STRESSARENA / 4096];
+	long np = nthreads > 1 ? nthreads / 2 : 1, nc = nthreads > 1 ? nthreads - np : 1, i, n;
+
+	/* leave a sixteenth free, less than the ring can hold */
+	for (i = 0; i < 4; i++) {
+		if ((held[i] = buddy_concurrent_alloc(c, STRESSARENA >> (i + 1))) == BUDDY_NOOFF) {
+			FAIL("wait: alloc of %lu failed\n", STRESSARENA >> (i + 1));
+		}
+	}
+	rhead = rtail = timeouts = 0;
+	done = false;
+	for (i = 0; i < nc; i++) {
+		if ((errno = pthread_create(&t[i], NULL, consumer, NULL)) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	spawn(producer, np, 0);
+	pthread_mutex_lock(&rlock);
+	done = true;
+	pthread_cond_broadcast(&rcond);
+	pthread_mutex_unlock(&rlock);
+	for (i = 0; i < nc; i++) {
+		pthread_join(t[i], NULL);
+	}
+	if (timeouts != 0) {
+		FAIL("wait: %ld producers timed out\n", timeouts);
+	}
+	for (i = 0; i < 4; i++) {
+		buddy_concurrent_free(c, held[i]);
+	}
+	checkempty("wait");
+
+	off = buddy_concurrent_alloc(c, STRESSARENA);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	req[1] = buddy_concurrent_alloc_wait(c, 64, &to);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (req[1] != BUDDY_NOOFF || errno != ETIMEDOUT || msec(&t0, &t1) < 19) {
+		FAIL("wait: full arena gave %zu after %.1f ms\n", req[1], msec(&t0, &t1));
+	}
+	/* woken by a free from this thread */
+	req[0] = 64;
+	startwaiter(&w, req);
+	usleep(20000);
+	buddy_concurrent_free(c, off);
+	pthread_join(w, NULL);
+	if (req[1] == BUDDY_NOOFF) {
+		FAIL("wait: waiter not woken by a free\n");
+	} else {
+		buddy_concurrent_free(c, req[1]);
+	}
+	checkempty("wait");
+
+	/*
+	 * the first 64k freed again in pages, which go to the cache of this
+	 * cpu. a waiter for all of it has to take them out of there.
+	 */
+	for (n = 0; n < (long)(STRESSARENA / 4096) &&
+	    (blk[n] = buddy_concurrent_alloc(c, 4096)) != BUDDY_NOOFF; n++)
+		;
+	for (i = 0; i < n; i++) {
+		if (blk[i] < 65536) {
+			buddy_concurrent_free(c, blk[i]);
+		}
+	}
+	req[0] = 65536;
+	startwaiter(&w, req);
+	pthread_join(w, NULL);
+	if (req[1] == BUDDY_NOOFF) {
+		FAIL("wait: waiter didn't get the cached blocks\n");
+	} else {
+		buddy_concurrent_free(c, req[1]);
+	}
+	for (i = 0; i < n; i++) {
+		if (blk[i] >= 65536) {
+			buddy_concurrent_free(c, blk[i]);
+		}
+	}
+	checkempty("wait");
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		void (*run)(void);
+	} work[] = {
+		{ "cross", runcross },
+		{ "double", rundouble },
+		{ "wait", runwait },
+	};
+	size_t i;
+	int before;
+	if (argc > 1) {
+		nthreads = atol(argv[1]);
+	}
+	if (argc > 2) {
+		iters = atol(argv[2]);
+	}
+	if (argc > 3 || nthreads < 1 || nthreads > STRESSMAXT || iters < 1) {
+		fprintf(stderr, "usage: budstress [threads [iterations]]\n");
+		return EXIT_FAILURE;
+	}
+	if ((arena = (unsigned char *)aligned_alloc(4096, STRESSARENA)) == NULL ||
+	    (c = buddy_concurrent_create(arena, STRESSARENA, STRESSK)) == NULL) {
+		perror("budstress");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < sizeof(work) / sizeof(work[0]); i++) {
+		before = failures;
+		work[i].run();
+		printf("%-8s%ld threads\t%ld iterations\t%s\n", work[i].name, nthreads, iters,
+			failures == before ? "ok" : "FAILED");
+	}
+	buddy_concurrent_destroy(c);
+	free(arena);
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,262 @@
+/*
+ * budtree is the bittree engine of budalloc with the geometry fixed at
+ * compile time. a BuddyTree<Levels, MinBlock> manages MinBlock << (Levels-1)
+ * bytes, the size, shift and first cell of every level are constexpr
+ * tables and the walk is a template recursion over the level, so there is
+ * no division left and a fixed geometry compiles down to an unrolled
+ * descent. requests for a size known at compile time (alloc<Sz>()) even
+ * get the level folded in.
+ *
+ * it keeps the same 2 bit cells, cell numbering and first fit order as
+ * buddy_allocator_t, for the same geometry both hand out the same offsets
+ * and bits() can be copied into a buddy_allocator_t to use the snapshot,
+ * foreach and analysis tools. like the c engine it only deals in offsets.
+ *
+ * BUDTREE_C_API(name, levels, minblock) exports one geometry to c as
+ * name_create/name_destroy/name_alloc/name_free/name_free_sized.
+ */
+#ifndef BUDTREE_HPP
+#define BUDTREE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * the same value budalloc.h has. the template needs nothing else from
+ * it and including it would tie every user to the library's TOTLVLS.
+ */
+#ifndef BUDDY_NOOFF
+#define BUDDY_NOOFF ((size_t)-1)
+#endif
+
+namespace budalloc {
+
+template <unsigned Levels, std::size_t MinBlock>
+class BuddyTree {
+	static_assert(Levels >= 1 && Levels <= 32, "1 to 32 levels");
+	static_assert(MinBlock != 0 && (MinBlock & (MinBlock - 1)) == 0,
+	    "the minimum block has to be a power of two");
+
+	struct geometry {
+		std::size_t size[Levels + 2];
+		unsigned shift[Levels + 2];
+		long first[Levels + 2];
+	};
+
+	static constexpr unsigned
+	log2(std::size_t v)
+	{
+		unsigned r = 0;
+		while (v >>= 1) {
+			r++;
+		}
+		return r;
+	}
+
+	static constexpr geometry
+	makegeometry()
+	{
+		geometry g{};
+		for (unsigned l = 1; l <= Levels + 1; l++) {
+			g.shift[l] = log2(MinBlock) + Levels - l;
+			g.size[l] = l <= Levels ? std::size_t(1) << g.shift[l] : 0;
+			g.first[l] = 1L << (l - 1);
+		}
+		return g;
+	}
+
+public:
+	static constexpr std::size_t memsz = MinBlock << (Levels - 1);
+	static constexpr std::size_t bitbytes = (((1UL << Levels) - 1) * 2) / 8 + 1;
+	static constexpr geometry geo = makegeometry();
+
+	enum : unsigned { FREE = 0, SPLIT = 2, FULL = 3 };
+
+	/* the level a request of sz bytes lands on, 0 if it can't fit at all */
+	static constexpr unsigned
+	level(std::size_t sz)
+	{
+		if (sz == 0 || sz > memsz) {
+			return 0;
+		}
+		if (sz <= MinBlock) {
+			return Levels;
+		}
+		return Levels - (log2(sz - 1) + 1 - log2(MinBlock));
+	}
+
+	std::size_t inuse = 0, unused = memsz, requested = 0;
+
+	std::size_t
+	alloc(std::size_t sz)
+	{
+		return allocat(level(sz), sz);
+	}
+
+	template <std::size_t Sz>
+	std::size_t
+	alloc()
+	{
+		constexpr unsigned lvl = level(Sz);
+		static_assert(lvl != 0, "request larger than the tree");
+		return allocat(lvl, Sz);
+	}
+
+	/* 0 if off was the start of an allocated block, -1 otherwise */
+	int
+	free(std::size_t off)
+	{
+		unsigned lvl;
+		if (off >= memsz || (lvl = freeat<1>(1, off)) == 0) {
+			return -1;
+		}
+		inuse -= geo.size[lvl];
+		unused += geo.size[lvl];
+		return 0;
+	}
+
+	/* like buddy_offset_free_sized(), sz picks the level up front */
+	int
+	free_sized(std::size_t off, std::size_t sz)
+	{
+		unsigned lvl = level(sz);
+		long cell;
+		if (lvl == 0 || off >= memsz || (off & (geo.size[lvl] - 1)) != 0) {
+			return -1;
+		}
+		cell = geo.first[lvl] + long(off >> geo.shift[lvl]);
+		if (state(cell) != FULL) {
+			return -1;
+		}
+		set(cell, FREE);
+		for (long c = cell; c > 1 && state(c ^ 1) == FREE; c >>= 1) {
+			set(c >> 1, FREE);
+		}
+		inuse -= geo.size[lvl];
+		unused += geo.size[lvl];
+		return 0;
+	}
+
+	/* size of the block allocated at off, 0 if off isn't the start of one */
+	std::size_t
+	size(std::size_t off) const
+	{
+		long cell = 1;
+		for (unsigned lvl = 1; lvl <= Levels && off < memsz; lvl++) {
+			unsigned s = state(cell);
+			if (s == FULL) {
+				return (off & (geo.size[lvl] - 1)) == 0 ? geo.size[lvl] : 0;
+			}
+			if (s != SPLIT) {
+				return 0;
+			}
+			cell = 2 * cell + long((off >> geo.shift[lvl + 1]) & 1);
+		}
+		return 0;
+	}
+
+	unsigned
+	state(long cell) const
+	{
+		return (bits_[(2 * cell - 2) / 8] >> ((2 * cell - 2) % 8)) & 3;
+	}
+
+	const unsigned char *
+	bits() const
+	{
+		return bits_;
+	}
+
+private:
+	unsigned char bits_[bitbytes] = {};
+
+	void
+	set(long cell, unsigned s)
+	{
+		unsigned char &byte = bits_[(2 * cell - 2) / 8];
+		unsigned sh = (2 * cell - 2) % 8;
+		byte = (byte & ~(3u << sh)) | (s << sh);
+	}
+
+	std::size_t
+	allocat(unsigned lvl, std::size_t sz)
+	{
+		std::size_t off = 0;
+		if (lvl == 0 || !descend<1>(lvl, 1, off)) {
+			return BUDDY_NOOFF;
+		}
+		requested += sz;
+		inuse += geo.size[lvl];
+		unused -= geo.size[lvl];
+		return off;
+	}
+
+	/* first fit, left before right, exactly like allocRecurse */
+	template <unsigned Lvl>
+	bool
+	descend(unsigned target, long cell, std::size_t &off)
+	{
+		unsigned s = state(cell);
+		if (s == FULL) {
+			return false;
+		}
+		if (Lvl == target) {
+			if (s != FREE) {
+				return false;
+			}
+			set(cell, FULL);
+			return true;
+		}
+		if constexpr (Lvl < Levels) {
+			if (descend<Lvl + 1>(target, 2 * cell, off)) {
+				set(cell, SPLIT);
+				return true;
+			}
+			if (descend<Lvl + 1>(target, 2 * cell + 1, off)) {
+				set(cell, SPLIT);
+				off += geo.size[Lvl + 1];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/* returns the level the block was freed on, 0 if there was none at rel */
+	template <unsigned Lvl>
+	unsigned
+	freeat(long cell, std::size_t rel)
+	{
+		unsigned s = state(cell), r = 0;
+		if (s == FULL) {
+			if (rel != 0) {
+				return 0;
+			}
+			set(cell, FREE);
+			return Lvl;
+		}
+		if constexpr (Lvl < Levels) {
+			if (s != SPLIT) {
+				return 0;
+			}
+			long child = 2 * cell + long((rel >> geo.shift[Lvl + 1]) & 1);
+			r = freeat<Lvl + 1>(child, rel & (geo.size[Lvl + 1] - 1));
+			if (r != 0 && state(2 * cell) == FREE && state(2 * cell + 1) == FREE) {
+				set(cell, FREE);
+			}
+		}
+		return r;
+	}
+};
+
+} /* namespace budalloc */
+
+#define BUDTREE_C_API(name, levels, minblock) \
+	typedef budalloc::BuddyTree<levels, minblock> name##_tree; \
+	extern "C" name##_tree *name##_create(void) { return new name##_tree(); } \
+	extern "C" void name##_destroy(name##_tree *t) { delete t; } \
+	extern "C" size_t name##_alloc(name##_tree *t, size_t sz) { return t->alloc(sz); } \
+	extern "C" int name##_free(name##_tree *t, size_t off) { return t->free(off); } \
+	extern "C" int name##_free_sized(name##_tree *t, size_t off, size_t sz) \
+	{ return t->free_sized(off, sz); }
+
+#endif /* BUDTREE_HPP */
@@ -0,0 +1,21 @@
+# writes a batch command file for budallocrepl -b, a random mix of allocs
+# with log uniform sizes up to max and frees of random live handles, with
+# at most live blocks held at once. the pgo build trains on it.
+#   awk -v n=100000 -v max=65536 -v live=2048 -v seed=1 -f mktrace.awk
+BEGIN {
+	if (n == "") n = 100000
+	if (max == "") max = 65536
+	if (live == "") live = 2048
+	srand(seed == "" ? 1 : seed)
+	for (i = 0; i < n; i++) {
+		if (nlive > 0 && (nlive >= live || rand() < 0.5)) {
+			j = int(rand() * nlive)
+			print "F " h[j]
+			h[j] = h[--nlive]
+		} else {
+			print "A " int(exp(rand() * log(max))) + 1
+			h[nlive++] = nh++
+		}
+	}
+	print "Q"
+}